@@ -0,0 +1,191 @@
+#ifndef HOSTBENCH_HOSTBENCH_H
+#define HOSTBENCH_HOSTBENCH_H
+
+/*
+ * hostbench/include/hostbench.h
+ * Host benchmark support
+ *  Stubs and setup shared by the host benchmarks
+ *  Included once by each benchmark (it defines the stubbed kernel symbols)
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
+
+#include "global.h"
+#include "cpu.h"
+#include "infopage.h"
+#include "kmemory.h"
+#include "multiboot.h"
+
+// Base of the direct map (CONFIG_HOSTBENCH moves it here from the top of memory)
+#define HOST_DIRECT_MAP         KMEM_PHYSICAL_BASE
+
+// Amount of fake physical memory
+#define HOST_MEMORY_SIZE        (64UL << 20)
+
+// Fake physical memory at the top which the allocator doesn't use (for user pages)
+#define HOST_USER_MEMORY_SIZE   (4UL << 20)
+#define HOST_USER_MEMORY        (HOST_MEMORY_SIZE - HOST_USER_MEMORY_SIZE)
+
+// Returns the direct map address of a fake physical address
+#define HOST_PHYS(addr)         ((void *) (HOST_DIRECT_MAP + (addr)))
+
+// Maximum number of cpus a benchmark can create
+#define HOST_MAX_CPUS           64
+
+// ##################################################################
+//  Kernel Stubs
+// ##################################################################
+
+Cpu * CpuList[HOST_MAX_CPUS];
+uint32_t CpuCount;
+uint64_t CpuTscFreq = 2000000000UL;
+InfoPageType InfoPage;
+
+char CpuLowerInit[1], CpuLowerInitEnd[1];
+char KernelPhysicalStart[1], KernelPhysicalEnd[1];
+
+// Number of run queue operations (counted by sched.c)
+uint64_t HostQueueOps;
+
+// Number of interprocessor interrupts the kernel tried to send
+uint64_t HostIpis;
+
+void CpuSendIpi(UNUSED Cpu * dest, UNUSED uint32_t lowFields)
+{
+    HostIpis++;
+}
+
+void CpuSendIpiOthers(UNUSED uint32_t lowFields)
+{
+    HostIpis += CpuCount - 1;
+}
+
+void CpuSetTimer(UNUSED uint64_t tsc)
+{
+}
+
+// Emulated cr3 register (used by memory.c)
+uint64_t HostCr3;
+
+// Number of cr3 loads, and the number which flushed the TLB
+uint64_t HostCr3Loads;
+uint64_t HostCr3Flushes;
+
+void HostCr3Load(uint64_t cr3)
+{
+    HostCr3 = cr3 & ~(1UL << 63);
+    HostCr3Loads++;
+
+    // Bit 63 keeps the TLB entries of the new PCID
+    if (!(cr3 & (1UL << 63)))
+        HostCr3Flushes++;
+}
+
+void Panic(const char * msg)
+{
+    fprintf(stderr, "PANIC: %s\n", msg);
+    exit(1);
+}
+
+void PanicAssert(const char * assertion, const char * file, const char * function)
+{
+    fprintf(stderr, "Assertion failed: %s (%s, %s)\n", assertion, file, function);
+    exit(1);
+}
+
+// ##################################################################
+//  Setup
+// ##################################################################
+
+// Sets the cpu returned by CpuCurrent for the calling host thread
+static inline void HostSetCpu(Cpu * cpu)
+{
+    cpu->self = cpu;
+    syscall(SYS_arch_prctl, ARCH_SET_GS, cpu);
+}
+
+// Creates the fake physical memory and initializes the page allocator
+//  Cpus are added to CpuList but are not initialized any further
+static void HostBoot(Cpu * cpus, uint32_t count)
+{
+    if (mmap(HOST_PHYS(0), HOST_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    // Everything above 1MB is usable except the user memory (which is reserved)
+    MultibootInfo * bootInfo = HOST_PHYS(0x9000);
+    MultibootMmapEntry * entry = HOST_PHYS(0x9100);
+
+    entry[0].size = sizeof(MultibootMmapEntry) - 4;
+    entry[0].addr = 0x100000;
+    entry[0].len = HOST_USER_MEMORY - 0x100000;
+    entry[0].type = 1;
+
+    entry[1].size = sizeof(MultibootMmapEntry) - 4;
+    entry[1].addr = HOST_USER_MEMORY;
+    entry[1].len = HOST_USER_MEMORY_SIZE;
+    entry[1].type = 2;
+
+    bootInfo->flags = MULTIBOOT_INFO_MEM_MAP;
+    bootInfo->mmap_addr = 0x9100;
+    bootInfo->mmap_length = 2 * sizeof(MultibootMmapEntry);
+
+    // Setup cpus
+    for (uint32_t i = 0; i < count; i++)
+    {
+        cpus[i].self = &cpus[i];
+        cpus[i].id = i;
+        CpuList[i] = &cpus[i];
+    }
+
+    CpuCount = count;
+    HostSetCpu(&cpus[0]);
+
+    KMemInit(bootInfo);
+}
+
+// ##################################################################
+//  Timing
+// ##################################################################
+
+// Reads the timestamp counter
+static inline uint64_t HostCycles(void)
+{
+    uint32_t low, high;
+    __asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+// Returns the wall clock time in seconds
+static inline double HostSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+#  hostbench/run.sh
+#  Builds and runs a kernel benchmark as a normal host (Linux AMD64) program
+#
+#  Copyright (C) 2013 James Cowgill
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#  Usage: run.sh <benchmark> [<benchmark args>]
+#
+#  The kernel sources are built with CONFIG_HOSTBENCH so they can run in a
+#  user process (see config.h). The benchmark goes in $HOSTBENCH_DIR (default
+#  /tmp/hostbench).
+#
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <benchmark> [<benchmark args>]" >&2
+    echo "Benchmarks:" $(cd "$(dirname "$0")/src" && ls *.c | sed 's/\.c$//') >&2
+    exit 1
+fi
+
+HOSTBENCH=$(cd "$(dirname "$0")" && pwd)
+KERNEL=$(dirname "$HOSTBENCH")/kernel
+OUT=${HOSTBENCH_DIR:-/tmp/hostbench}
+CC=${CC:-gcc}
+
+BENCH=$1
+shift
+
+# Kernel sources each benchmark needs
+case $BENCH in
+    queueops)   SOURCES="kmemory memory slab mapdb thread ipc sched time thread_asm.s" ;;
+    kmemcontend)SOURCES="kmemory" ;;
+    strcopy)    SOURCES="kmemory memory slab mapdb thread sched time thread_asm.s" ;;
+    faultipc)   SOURCES="kmemory memory slab mapdb thread ipc sched time thread_asm.s" ;;
+    pcidswitch) SOURCES="kmemory slab" ;;
+    schedpick)  SOURCES="kmemory memory slab mapdb thread ipc sched time thread_asm.s" ;;
+    *)          echo "Unknown benchmark $BENCH" >&2; exit 1 ;;
+esac
+
+# Build
+FILES=
+for src in $SOURCES; do
+    case $src in
+        *.s)    FILES="$FILES $KERNEL/src/$src" ;;
+        *)      FILES="$FILES $KERNEL/src/$src.c" ;;
+    esac
+done
+
+# The kernel's own #warning Todo lines are hidden (-Wno-cpp)
+mkdir -p "$OUT"
+$CC -O2 -g -std=gnu99 -Wall -Wextra -Wno-cpp -DCONFIG_HOSTBENCH -no-pie -pthread \
+    -Wl,-z,noexecstack -iquote "$HOSTBENCH/include" -iquote "$KERNEL/include" -iquote "$KERNEL/src" \
+    -o "$OUT/$BENCH" "$HOSTBENCH/src/$BENCH.c" $FILES
+
+# Run
+"$OUT/$BENCH" "$@"
@@ -0,0 +1,154 @@
+/*
+ * hostbench/src/faultipc.c
+ * Page fault IPC latency
+ *  Times IpcPageFault for a thread whose pager (in another address space)
+ *  replies with a map item, from the fault message to the thread resuming
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostbench.h"
+#include "ipc.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
+
+// Number of faults (each on a new page)
+#define FAULTS          10000
+
+// Thread ids
+#define PAGER_ID        ((2UL << THREAD_ID_VERSION_BITS) | 1)
+#define CLIENT_ID       ((3UL << THREAD_ID_VERSION_BITS) | 1)
+
+// Page the pager maps at every faulting address
+#define PAGER_PAGE      0x10000000
+
+// Address of the first fault
+#define FAULT_BASE      0x40000000
+
+// Timeouts word with an infinite send and receive timeout
+#define NEVER           0
+
+static Cpu cpu;
+static MemSpace pagerSpace, clientSpace;
+static Thread * pager, * client;
+
+// Creates a thread which starts by calling main
+static Thread * CreateThread(uint64_t id, MemSpace * space, void (* main)(void))
+{
+    Thread * thread = KMemAllocate();
+    memset(thread, 0, sizeof(Thread));
+
+    thread->state = THREAD_STATE_RUNNING;
+    thread->priority = THREAD_DEFAULT_PRIORITY;
+    thread->id = id;
+    thread->cpu = &cpu;
+    thread->space = space;
+    thread->pager = PAGER_ID;
+    ListInit(&thread->senders);
+    ListInit(&thread->receivers);
+
+    if (!ThreadSetUtcb(thread, 0x7000000000))
+        Panic("CreateThread: could not create UTCB");
+
+    // Frame popped by ThreadSwitchStack (6 saved registers and the return address)
+    uint64_t * rsp = (uint64_t *) ThreadStackTop(thread);
+    *--rsp = 0;
+    *--rsp = (uint64_t) main;
+    for (int i = 0; i < 6; i++)
+        *--rsp = 0;
+
+    thread->kernelRsp = (uint64_t) rsp;
+    ThreadTable[id >> THREAD_ID_VERSION_BITS] = thread;
+    return thread;
+}
+
+// Maps PAGER_PAGE at every faulting address
+static void PagerMain(void)
+{
+    SyscallResult result = IpcSyscall(THREAD_ID_NIL, THREAD_ID_ANY, NEVER, 0, 0, 0);
+
+    for (;;)
+    {
+        uint64_t addr = pager->utcb->mr[1];
+
+        pager->utcb->mr[1] = (addr & ~(MEM_PAGE_4KB - 1)) | IPC_ITEM_MAP;
+        pager->utcb->mr[2] = MapFpageCreate(PAGER_PAGE, 12, MAP_RIGHTS_ALL);
+
+        result = IpcSyscall(result.rax, THREAD_ID_ANY, NEVER, IpcTagCreate(0, 0, 2), 0, 0);
+    }
+}
+
+static void ClientMain(void)
+{
+    uint64_t pAddr, flags;
+
+    // Warm up
+    IpcPageFault(client, FAULT_BASE - MEM_PAGE_4KB, 0, MAP_RIGHT_W);
+
+    HostCr3Loads = 0;
+    uint64_t start = HostCycles();
+
+    for (int i = 0; i < FAULTS; i++)
+        IpcPageFault(client, FAULT_BASE + i * MEM_PAGE_4KB, 0, MAP_RIGHT_W);
+
+    uint64_t cycles = HostCycles() - start;
+
+    // Check the last fault was resolved
+    if (!MemSpaceLookup(&clientSpace, FAULT_BASE + (FAULTS - 1) * MEM_PAGE_4KB, &pAddr, &flags) ||
+        pAddr != HOST_USER_MEMORY)
+    {
+        Panic("ClientMain: fault not resolved");
+    }
+
+    printf("fault to resume (write, 4KB map item) %8.0f cycles\n", cycles / (double) FAULTS);
+    printf("address space switches per fault      %8.2f\n", HostCr3Loads / (double) FAULTS);
+    exit(0);
+}
+
+int main(void)
+{
+    HostBoot(&cpu, 1);
+
+    MemInitCpu(&cpu.mem);
+    ThreadInitCpu(&cpu);
+    MapInit();
+    ThreadInit();
+    SchedInitCpu(&cpu);
+    TimeInit();
+    TimeInitCpu(&cpu);
+
+    if (!MemSpaceInit(&pagerSpace) || !MemSpaceInit(&clientSpace) ||
+        !MapRoot(&pagerSpace, PAGER_PAGE, HOST_USER_MEMORY, MEM_PAGE_4KB, MAP_RIGHTS_ALL))
+    {
+        Panic("main: could not create address spaces");
+    }
+
+    ListInit(&pagerSpace.threads);
+    ListInit(&clientSpace.threads);
+
+    pager = CreateThread(PAGER_ID, &pagerSpace, PagerMain);
+    client = CreateThread(CLIENT_ID, &clientSpace, ClientMain);
+
+    // The pager waits for the first fault
+    ThreadSwitch(pager);
+    SchedAdd(client);
+    ThreadSwitch(client);
+
+    Panic("main: client returned");
+}
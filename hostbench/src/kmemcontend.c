@@ -0,0 +1,127 @@
+/*
+ * hostbench/src/kmemcontend.c
+ * Page allocator contention
+ *  Every cpu allocates and frees pages as fast as it can, first with the
+ *  per-cpu page caches disabled and then with them enabled
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include "hostbench.h"
+
+// Pages each cpu holds at once
+#define BATCH   8
+
+// Length of each test in seconds
+#define SECONDS 1
+
+static Cpu cpus[HOST_MAX_CPUS];
+static uint64_t pagesDone[HOST_MAX_CPUS];
+
+static volatile bool running;
+static volatile uint32_t ready;
+
+// Allocates and frees pages until running is cleared
+static void * CpuMain(void * arg)
+{
+    Cpu * cpu = arg;
+    void * pages[BATCH];
+    uint64_t done = 0;
+
+    HostSetCpu(cpu);
+
+    __sync_fetch_and_add(&ready, 1);
+    while (!running)
+        ;
+
+    while (running)
+    {
+        for (int i = 0; i < BATCH; i++)
+        {
+            pages[i] = KMemAllocate();
+            if (pages[i] == NULL)
+                Panic("CpuMain: out of memory");
+        }
+
+        for (int i = 0; i < BATCH; i++)
+            KMemFree(pages[i]);
+
+        done += BATCH;
+    }
+
+    pagesDone[cpu->id] = done;
+    return NULL;
+}
+
+// Runs one test on every cpu and prints the results
+static void Test(const char * name)
+{
+    pthread_t threads[HOST_MAX_CPUS];
+    uint64_t total = 0;
+
+    ready = 0;
+    for (uint32_t i = 0; i < CpuCount; i++)
+        pthread_create(&threads[i], NULL, CpuMain, &cpus[i]);
+
+    while (ready != CpuCount)
+        ;
+
+    double start = HostSeconds();
+    running = true;
+    sleep(SECONDS);
+    running = false;
+
+    for (uint32_t i = 0; i < CpuCount; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total += pagesDone[i];
+    }
+
+    double time = HostSeconds() - start;
+
+    printf("%-12s %4u cpus %12.0f pages/sec per cpu %12.0f pages/sec total\n",
+        name, CpuCount, total / time / CpuCount, total / time);
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+
+    if (count < 1 || count > HOST_MAX_CPUS)
+    {
+        fprintf(stderr, "Usage: kmemcontend [<cpus (1-%d)>]\n", HOST_MAX_CPUS);
+        return 1;
+    }
+
+    HostBoot(cpus, count);
+
+    Test("no caches");
+
+    for (uint32_t i = 0; i < count; i++)
+        KMemCpuCacheInit(&cpus[i].kmemCache);
+
+    KMemCpuCacheEnable();
+    Test("cpu caches");
+
+    KMemStats stats;
+    KMemGetStats(&stats);
+    printf("lock spins with cpu caches: %lu\n", stats.lockSpins);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * hostbench/src/pcidswitch.c
+ * TLB flushes per address space switch
+ *  Switches between address spaces in turn and counts the cr3 loads which
+ *  would flush the TLB, with and without PCIDs
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostbench.h"
+
+// MemPcidEnabled is static
+#include "memory.c"
+
+// Number of switches in each test
+#define SWITCHES        100000
+
+// Largest number of address spaces used
+#define MAX_SPACES      32
+
+static Cpu cpu;
+static MemSpace spaces[MAX_SPACES];
+
+// Maps the page unmapped by Test
+static void MapPage(MemSpace * space)
+{
+    if (!MemSpaceMapData(space, 0x10000, HOST_USER_MEMORY, MEM_PAGE_4KB,
+                         MEM_PAGE_USER | MEM_PAGE_WRITABLE, NULL, NULL))
+    {
+        Panic("MapPage: out of memory");
+    }
+}
+
+// Switches between count spaces in turn and prints the flushes per switch
+//  If changeEvery is not 0, a page is unmapped from the next space every changeEvery switches
+static void Test(bool pcid, bool invpcid, uint32_t count, uint32_t changeEvery)
+{
+    MemInitCpu(&cpu.mem);
+    MemPcidEnabled = pcid;
+    MemInvpcidEnabled = invpcid;
+    HostCr3 = 0;
+
+    // Warm up
+    for (uint32_t i = 0; i < count; i++)
+        MemSpaceSwitch(&spaces[i]);
+
+    HostCr3Loads = 0;
+    HostCr3Flushes = 0;
+
+    for (uint32_t i = 0; i < SWITCHES; i++)
+    {
+        MemSpace * next = &spaces[i % count];
+
+        if (changeEvery && i % changeEvery == 0)
+        {
+            MemSpaceUnmap(next, 0x10000, MEM_PAGE_4KB, NULL);
+            MapPage(next);
+        }
+
+        MemSpaceSwitch(next);
+    }
+
+    printf("%-14s %3u spaces, unmap every %3u %6.2f loads %6.2f flushes\n",
+        invpcid ? "PCID+INVPCID" : pcid ? "PCID" : "none", count, changeEvery,
+        HostCr3Loads / (double) SWITCHES, HostCr3Flushes / (double) SWITCHES);
+}
+
+int main(void)
+{
+    HostBoot(&cpu, 1);
+
+    for (uint32_t i = 0; i < MAX_SPACES; i++)
+    {
+        if (!MemSpaceInit(&spaces[i]))
+            Panic("main: could not create address spaces");
+
+        MapPage(&spaces[i]);
+    }
+
+    // Without PCIDs every switch flushes, so only one test is needed
+    Test(false, false, 2, 0);
+
+    Test(true, false, 2, 0);
+    Test(true, false, MEM_PCID_COUNT - 1, 0);
+    Test(true, false, MEM_PCID_COUNT, 0);
+    Test(true, false, 2, 10);
+    Test(true, true, 2, 10);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * hostbench/src/queueops.c
+ * Run queue operations per IPC
+ *  Counts how many times the scheduler inserts or deletes a thread from a run
+ *  queue while two threads on the same cpu exchange messages, and how many
+ *  cycles each message takes (not including the system call entry and exit)
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostbench.h"
+#include "ipc.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
+
+// Number of messages sent in each test
+#define MESSAGES        10000
+
+// Thread ids
+#define SERVER_ID       ((2UL << THREAD_ID_VERSION_BITS) | 1)
+#define CLIENT_ID       ((3UL << THREAD_ID_VERSION_BITS) | 1)
+
+// Label of messages the server doesn't reply to
+#define LABEL_NOTIFY    1
+
+// Timeouts word with an infinite send and receive timeout
+#define NEVER           0
+
+static Cpu cpu;
+static MemSpace space;
+static Thread * server, * client;
+
+// Creates a thread which starts by calling main
+static Thread * CreateThread(uint64_t id, uint8_t priority, void (* main)(void))
+{
+    static uint64_t utcbAddr = 0x7000000000;
+
+    Thread * thread = KMemAllocate();
+    memset(thread, 0, sizeof(Thread));
+
+    thread->state = THREAD_STATE_RUNNING;
+    thread->priority = priority;
+    thread->id = id;
+    thread->cpu = &cpu;
+    thread->space = &space;
+    ListInit(&thread->senders);
+    ListInit(&thread->receivers);
+
+    if (!ThreadSetUtcb(thread, utcbAddr))
+        Panic("CreateThread: could not create UTCB");
+
+    utcbAddr += UTCB_SIZE;
+
+    // Frame popped by ThreadSwitchStack (6 saved registers and the return address)
+    uint64_t * rsp = (uint64_t *) ThreadStackTop(thread);
+    *--rsp = 0;
+    *--rsp = (uint64_t) main;
+    for (int i = 0; i < 6; i++)
+        *--rsp = 0;
+
+    thread->kernelRsp = (uint64_t) rsp;
+    ThreadTable[id >> THREAD_ID_VERSION_BITS] = thread;
+    return thread;
+}
+
+// Replies to every message except notifications
+static void ServerMain(void)
+{
+    SyscallResult result = IpcSyscall(THREAD_ID_NIL, THREAD_ID_ANY, NEVER, 0, 0, 0);
+
+    for (;;)
+    {
+        if (IPC_TAG_LABEL(result.rdx) == LABEL_NOTIFY)
+            result = IpcSyscall(THREAD_ID_NIL, THREAD_ID_ANY, NEVER, 0, 0, 0);
+        else
+            result = IpcSyscall(result.rax, THREAD_ID_ANY, NEVER, server->utcb->mr[0], 0, 0);
+    }
+}
+
+// Runs one test and prints the queue operations and cycles per message
+static void Test(const char * name, uint64_t fromId, uint64_t tag)
+{
+    // Warm up
+    IpcSyscall(SERVER_ID, fromId, NEVER, tag, 0, 0);
+
+    HostQueueOps = 0;
+    uint64_t start = HostCycles();
+
+    for (int i = 0; i < MESSAGES; i++)
+        IpcSyscall(SERVER_ID, fromId, NEVER, tag, 0, 0);
+
+    uint64_t cycles = HostCycles() - start;
+
+    printf("%-36s %6.2f %8.0f\n", name,
+        HostQueueOps / (double) MESSAGES, cycles / (double) MESSAGES);
+}
+
+static void ClientMain(void)
+{
+    printf("%-36s %6s %8s\n", "Test", "Ops", "Cycles");
+
+    // Send only (the server waits again while the client keeps running)
+    Test("send (slow path)", THREAD_ID_NIL, IpcTagCreate(LABEL_NOTIFY, 1, 0));
+
+    // Call and reply with 8 untyped words (too many for the fast path)
+    Test("call/reply (slow path)", SERVER_ID, IpcTagCreate(0, 8, 0));
+
+    // Call and reply with 1 untyped word
+    Test("call/reply (fast path)", SERVER_ID, IpcTagCreate(0, 1, 0));
+
+    exit(0);
+}
+
+int main(void)
+{
+    HostBoot(&cpu, 1);
+
+    MemInitCpu(&cpu.mem);
+    ThreadInitCpu(&cpu);
+    MapInit();
+    ThreadInit();
+    MemSpaceInit(&space);
+    ListInit(&space.threads);
+    SchedInitCpu(&cpu);
+    TimeInit();
+    TimeInitCpu(&cpu);
+
+    // The server has a higher priority so it waits before the client sends
+    server = CreateThread(SERVER_ID, 200, ServerMain);
+    client = CreateThread(CLIENT_ID, 100, ClientMain);
+
+    ThreadSwitch(server);
+    SchedAdd(client);
+    ThreadSwitch(client);
+
+    Panic("main: client returned");
+}
@@ -0,0 +1,128 @@
+/*
+ * hostbench/src/schedpick.c
+ * Scheduler pick cost
+ *  Times SchedNext with runnable threads at different priorities, and the
+ *  block / pick / wake cycle with threads spread over different numbers of
+ *  priorities
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostbench.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
+
+// Number of times each test is run
+#define ITERATIONS      1000000
+
+// Number of threads used by the block / pick / wake tests
+#define THREADS         256
+
+static Cpu cpu;
+static Thread threads[THREADS];
+
+// Makes thread a runnable thread on the benchmark cpu with the given priority
+static void ThreadReset(Thread * thread, uint8_t priority)
+{
+    memset(thread, 0, sizeof(Thread));
+    thread->state = THREAD_STATE_RUNNING;
+    thread->priority = priority;
+    thread->cpu = &cpu;
+    ListInit(&thread->senders);
+    ListInit(&thread->receivers);
+}
+
+// Removes all the threads from the run queues
+static void Empty(void)
+{
+    for (int i = 0; i < THREADS; i++)
+        SchedRemove(&threads[i]);
+}
+
+// Times SchedNext with one runnable thread at the given priority
+static void TestPick(uint8_t priority)
+{
+    ThreadReset(&threads[0], priority);
+    SchedAdd(&threads[0]);
+
+    uint64_t start = HostCycles();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        if (SchedNext() != &threads[0])
+            Panic("TestPick: wrong thread picked");
+    }
+    uint64_t cycles = HostCycles() - start;
+
+    printf("pick, thread at priority %3u        %6.1f cycles\n",
+        priority, cycles / (double) ITERATIONS);
+    Empty();
+}
+
+// Times the cycle of picking a thread, blocking it and waking the previous one
+//  with the threads spread evenly over the given number of priorities
+static void TestBlockWake(uint32_t priorities)
+{
+    for (int i = 0; i < THREADS; i++)
+    {
+        ThreadReset(&threads[i], (i % priorities) * (SCHED_PRIORITIES / priorities));
+        SchedAdd(&threads[i]);
+    }
+
+    Thread * previous = NULL;
+    uint64_t queueOps = HostQueueOps;
+
+    uint64_t start = HostCycles();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        Thread * next = SchedNext();
+        next->state = THREAD_STATE_RECEIVING;
+
+        if (previous)
+        {
+            previous->state = THREAD_STATE_RUNNING;
+            SchedAdd(previous);
+        }
+
+        previous = next;
+    }
+    uint64_t cycles = HostCycles() - start;
+
+    printf("block/wake, %3u priorities          %6.1f cycles %5.2f queue ops\n",
+        priorities, cycles / (double) ITERATIONS,
+        (HostQueueOps - queueOps) / (double) ITERATIONS);
+    Empty();
+}
+
+int main(void)
+{
+    HostBoot(&cpu, 1);
+
+    ThreadInitCpu(&cpu);
+    SchedInitCpu(&cpu);
+    TimeInit();
+    TimeInitCpu(&cpu);
+
+    TestPick(255);
+    TestPick(128);
+    TestPick(64);
+    TestPick(0);
+
+    TestBlockWake(1);
+    TestBlockWake(16);
+    TestBlockWake(256);
+    return 0;
+}
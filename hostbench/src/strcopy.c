@@ -0,0 +1,96 @@
+/*
+ * hostbench/src/strcopy.c
+ * String item copy throughput
+ *  Times IpcCopyString copying between two address spaces and compares it with
+ *  a memcpy of the same physical pages
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hostbench.h"
+
+// IpcCopyString is static
+#include "ipc.c"
+
+// Bytes copied by each test
+#define TOTAL_BYTES     (1UL << 30)
+
+// Virtual addresses of the buffers
+#define SRC_ADDR        0x10000000
+#define DST_ADDR        0x20000000
+
+// Size of each buffer (each is half the user memory)
+#define BUFFER_SIZE     (HOST_USER_MEMORY_SIZE / 2)
+
+static Cpu cpu;
+
+// Runs one test and prints the results
+static void Test(MemSpace * src, MemSpace * dst, uint64_t size)
+{
+    uint64_t count = TOTAL_BYTES / size;
+    uint64_t start, stringCycles, memcpyCycles;
+
+    void * srcPtr = HOST_PHYS(HOST_USER_MEMORY);
+    void * dstPtr = HOST_PHYS(HOST_USER_MEMORY + BUFFER_SIZE);
+
+    // String copy
+    start = HostCycles();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (IpcCopyString(src, SRC_ADDR, dst, DST_ADDR, size) != 0)
+            Panic("Test: copy failed");
+    }
+    stringCycles = (HostCycles() - start) / count;
+
+    // Baseline
+    start = HostCycles();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        memcpy(dstPtr, srcPtr, size);
+        __asm volatile("" : : "r" (dstPtr) : "memory");
+    }
+    memcpyCycles = (HostCycles() - start) / count;
+
+    printf("%8lu %12lu %10.2f %12lu %10.2f\n", size,
+        stringCycles, (double) size / stringCycles,
+        memcpyCycles, (double) size / memcpyCycles);
+}
+
+int main(void)
+{
+    HostBoot(&cpu, 1);
+
+    MemInitCpu(&cpu.mem);
+    MapInit();
+
+    // Map half of the user memory in each space
+    MemSpace src, dst;
+
+    if (!MemSpaceInit(&src) || !MemSpaceInit(&dst) ||
+        !MapRoot(&src, SRC_ADDR, HOST_USER_MEMORY, BUFFER_SIZE, MAP_RIGHTS_ALL) ||
+        !MapRoot(&dst, DST_ADDR, HOST_USER_MEMORY + BUFFER_SIZE, BUFFER_SIZE, MAP_RIGHTS_ALL))
+    {
+        Panic("main: could not create address spaces");
+    }
+
+    memset(HOST_PHYS(HOST_USER_MEMORY), 0xAA, HOST_USER_MEMORY_SIZE);
+
+    printf("%8s %12s %10s %12s %10s\n", "Bytes", "Cycles", "Bytes/cyc", "memcpy", "Bytes/cyc");
+    Test(&src, &dst, 4096);
+    Test(&src, &dst, 65536);
+    Test(&src, &dst, 1048576);
+    return 0;
+}
@@ -75,8 +75,17 @@ static inline void AtomicLockInit(AtomicSpinlock * lock)
 //  The original value (whatever it was) is returned
 #define AtomicCompareSwap(ptr, old, new) __sync_val_compare_and_swap(ptr, old, new)
 
+// Exchange operation
+//  Atomically copies value into *ptr and returns the original value (full barrier)
+#define AtomicExchange(ptr, value) __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST)
+
 // Atomic Addition
 //  Atomically adds value to *ptr and returns the new value in *ptr
 #define AtomicAdd(ptr, value) __sync_add_and_fetch(ptr, value)
 
+// Atomic bitwise operations
+//  Atomically ors / ands value into *ptr and returns the new value in *ptr
+#define AtomicOr(ptr, value) __sync_or_and_fetch(ptr, value)
+#define AtomicAnd(ptr, value) __sync_and_and_fetch(ptr, value)
+
 #endif
@@ -42,7 +42,17 @@
 // Extra version data (max 95 bytes)
 #define CONFIG_VERSION_EXTRA    ("CowL4. James Cowgill. Built " __DATE__ ".")
 
-// Timer interrupt rate
-#define CONFIG_HZ           1000
+// Number of bits in thread numbers (the thread table has 2^bits entries)
+#define CONFIG_THREAD_BITS  16
+
+// Record the caller of every page allocation so leaks can be found
+//  Costs 16 bytes of memory per page
+//#define CONFIG_KMEM_DEBUG
+
+// Build the kernel into a host benchmark (defined by hostbench/run.sh)
+//  The direct map moves into user memory, the C library string functions are
+//  used, privileged instructions are passed to the benchmark or left out, and
+//  run queue operations are counted
+//#define CONFIG_HOSTBENCH
 
 #endif
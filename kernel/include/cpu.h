@@ -22,16 +22,43 @@
  */
 
 #include "global.h"
+#include "kmemory.h"
+#include "memory.h"
+#include "sched.h"
+#include "time.h"
+
+struct Thread;
+struct ThreadMail;
 
 // Information about a cpu and per-cpu fields
+//  The gs segment points to the current cpu's structure while in the kernel
 typedef struct Cpu
 {
+    // These fields are used by intr_asm.s (don't move them)
+    struct Cpu * self;      // Pointer to this structure
+    uint64_t kernelStack;   // Stack used by system calls (top of the current thread's stack)
+    uint64_t userStack;     // User stack pointer while entering a system call
+
     uint32_t id;            // Logical ID of this cpu (= index in CpuList)
     uint8_t  apicId;        // ID of the cpu's local APIC
+    uint32_t node;          // NUMA node this cpu is in
+    uint32_t core;          // Physical core this cpu is in (APIC id without the SMT bits)
+    uint32_t package;       // Package this cpu is in (APIC id without the core and SMT bits)
 
     uint64_t gdt[7];        // The GDT for this CPU
     uint32_t tss[0x68];     // The TSS for this CPU
 
+    KMemCpuCache kmemCache; // Cache of free pages owned by this CPU
+    MemCpuState mem;        // Address space state (PCIDs)
+
+    struct Thread * thread;     // Thread running on this cpu
+    struct Thread * idleThread; // Thread run when there is nothing else to do
+    SchedCpuState sched;        // Run queues
+    TimeWheel timer;            // Timer events
+
+    // Requests from other cpus (lock free stack, newest first)
+    struct ThreadMail * volatile mailbox;
+
 } Cpu;
 
 // List of all the cpus in the system
@@ -41,13 +68,65 @@ extern Cpu * CpuList[];
 // External bus frequency
 extern uint64_t CpuExternalBusFreq;
 
+// Time stamp counter frequency (the counters of all cpus are assumed to be in sync)
+extern uint64_t CpuTscFreq;
+
+// Executes the CPUID instruction
+//  regs is filled with eax, ebx, ecx and edx
+static inline void CpuId(uint32_t leaf, uint32_t subLeaf, uint32_t regs[4])
+{
+    __asm volatile("cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subLeaf));
+}
+
+// Model specific registers
+#define CPU_MSR_TSC_DEADLINE    0x000006E0  // Time stamp counter value the APIC timer fires at
+#define CPU_MSR_KERNEL_GS_BASE  0xC0000102  // User gs base while in the kernel (see swapgs)
+
+// Writes a model specific register
+static inline void CpuWriteMsr(uint32_t msr, uint64_t value)
+{
+#ifdef CONFIG_HOSTBENCH
+    (void) msr;
+    (void) value;
+#else
+    __asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+#endif
+}
+
+// Reads the time stamp counter
+static inline uint64_t CpuReadTsc(void)
+{
+    uint32_t low, high;
+    __asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
 // Returns the current cpu's structure
-Cpu * CpuCurrent(void);
+//  This is volatile since threads may move to another cpu while switched out
+static inline Cpu * CpuCurrent(void)
+{
+    Cpu * cpu;
+    __asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Sets the stack used by system calls and interrupts from user mode (rsp0 in the TSS)
+static inline void CpuSetKernelStack(Cpu * cpu, uint64_t stack)
+{
+    cpu->kernelStack = stack;
+    cpu->tss[1] = (uint32_t) stack;
+    cpu->tss[2] = (uint32_t) (stack >> 32);
+}
 
 // Sends an IPI to another processor
 //  lowFields contains what type of IPI to send
 void CpuSendIpi(Cpu * dest, uint32_t lowFields);
 
+// Sends an IPI to every processor except the current one
+void CpuSendIpiOthers(uint32_t lowFields);
+
 // Gets the current hardware interrupt number (IRQ)
 //  Returns number less than zero if there was no interrupt requested
 int CpuGetHardwareIntr(void);
@@ -55,6 +134,14 @@ int CpuGetHardwareIntr(void);
 // Sends an end-of-interrupt signal
 void CpuSendEoi(void);
 
+// Sets the APIC timer to interrupt once when the time stamp counter reaches tsc
+//  tsc = 0 stops the timer. Times in the past interrupt immediately
+void CpuSetTimer(uint64_t tsc);
+
+// Finds the NUMA nodes of all the CPUs and memory from the ACPI tables
+//  Must be called before KMemInit
+void CpuInitNuma(void);
+
 // Initializes all the CPUs (including the calling one) on the system
 void CpuInitAll(void);
 
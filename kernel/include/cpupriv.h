@@ -31,6 +31,14 @@
 // APIC flag which must be true to use that CPU
 #define ACPI_MADT_APIC_EN   1
 
+// SRAT entry types
+#define ACPI_SRAT_APIC          0
+#define ACPI_SRAT_MEMORY        1
+#define ACPI_SRAT_X2APIC        2
+
+// SRAT flag which must be true to use an entry
+#define ACPI_SRAT_EN        1
+
 // ACPI Root System Descriptor Pointer (old version)
 typedef struct AcpiRsdp
 {
@@ -75,6 +83,25 @@ typedef struct AcpiMadt
 
 } AcpiMadt;
 
+// The ACPI System Resource Affinity Table
+typedef struct AcpiSrat
+{
+    AcpiTableHeader header;         // Table header
+    uint32_t        reserved1;
+    uint64_t        reserved2;
+    uint8_t         data[];         // SRAT entries follow
+
+} AcpiSrat;
+
+// The ACPI System Locality Distance Information Table
+typedef struct AcpiSlit
+{
+    AcpiTableHeader header;         // Table header
+    uint64_t        localities;     // Number of localities (proximity domains)
+    uint8_t         entry[];        // Distance matrix (localities * localities)
+
+} PACKED AcpiSlit;
+
 // Local APIC entry in the MADT
 typedef struct AcpiMadtApic
 {
@@ -134,10 +161,15 @@ typedef struct AcpiMadtApic
 // Other APIC constants
 #define APIC_LVT_DISABLE    0x10000 // Disables an LVT interrupt
 
+#define APIC_TIMER_ONE_SHOT     0x00000 // LVT timer modes
+#define APIC_TIMER_PERIODIC     0x20000
+#define APIC_TIMER_TSC_DEADLINE 0x40000
+
 #define APIC_IPI_INIT       0x4500  // Low fields for an init ipi
 #define APIC_IPI_SIPI       0x4600  // Low fields for an startup ipi (except vector)
 
 #define APIC_IPI_BUSY       0x1000  // Bit set if APIC is sending an ipi
+#define APIC_IPI_OTHERS     0xC0000 // Destination shorthand for all cpus except this one
 
 // PIT constants
 #define PIT_PORT_CONTROL    0x43    // PIT Control Port
@@ -151,6 +183,15 @@ typedef struct AcpiMadtApic
 extern volatile uint8_t * CpuLocalApic;
 extern uint32_t CpuApicToCpuId[APIC_MAX_CPU];
 
+// NUMA node of each APIC id (from the SRAT)
+extern uint32_t CpuApicToNode[APIC_MAX_CPU];
+
+// True if the APIC timer runs in TSC-deadline mode (otherwise one shot mode is used)
+extern bool CpuTscDeadline;
+
+// APIC timer counts per time stamp counter tick (32.32 fixed point, for one shot mode)
+extern uint64_t CpuApicTimerMult;
+
 // Start and end points for lower cpu code
 extern char CpuLowerInit[1];
 extern char CpuLowerInitEnd[1];
@@ -159,7 +200,8 @@ extern char CpuLowerInitEnd[1];
 void NO_RETURN CpuApEntry(Cpu * cpu);
 
 // Assembly part of late initialization
-void CpuLateInitAsm(void * gdtPtr);
+//  Also points gs at the cpu structure
+void CpuLateInitAsm(void * gdtPtr, Cpu * cpu);
 
 // Reads the given 32-bit APIC register
 static inline uint32_t ApicRead32(uint16_t reg)
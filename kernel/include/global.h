@@ -35,7 +35,11 @@
 #define ALIGN(x)    __attribute__((aligned(x)))
 #define PACKED      __attribute__((packed))
 #define NO_RETURN   __attribute__((noreturn))
+#define UNUSED      __attribute__((unused))
 #define CLZ(x)      __builtin_clzl(x)
+#define CTZ(x)      __builtin_ctzl(x)
+#define LIKELY(x)   __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
 
 // Assert
 #define STRING(x)   #x
@@ -48,6 +52,9 @@
                         PanicAssert(STRING(x), __FILE__ ":" XSTRING(__LINE__), __func__))
 #endif
 
+// Compile time assert
+#define STATIC_ASSERT(x) _Static_assert(x, STRING(x))
+
 // Bochs breakpoints
 #define BREAKPOINT  __asm volatile("xchgw %bx, %bx")
 
@@ -56,6 +63,10 @@
 void NO_RETURN Panic(const char * msg);
 void NO_RETURN PanicAssert(const char * assertion, const char * file, const char * func);
 
+#ifdef CONFIG_HOSTBENCH
+// The host benchmarks use the C library versions
+# include <string.h>
+#else
 // memset - fills in a region of memory with the given value
 void * memset(void * dest, uint8_t value, uint64_t len);
 
@@ -64,5 +75,6 @@ void * memcpy(void * restrict dest, const void * restrict src, uint64_t len);
 
 // memcmp - compares regions of memory
 int memcmp(const void * restrict a, const void * restrict b, uint64_t len);
+#endif
 
 #endif
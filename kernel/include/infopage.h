@@ -22,6 +22,30 @@
  */
 
 #include "global.h"
+#include "kmemory.h"
+
+// Maximum number of memory descriptors in the information page
+//  One for each physical memory region, after the descriptor covering all of memory
+#define INFO_MAX_MEM_DESC       (KMEM_MAX_REGIONS + 1)
+
+// Memory descriptor types
+#define INFO_MEM_UNDEFINED      0x0
+#define INFO_MEM_CONVENTIONAL   0x1     // Conventional memory
+#define INFO_MEM_RESERVED       0x2     // Memory reserved by the kernel
+#define INFO_MEM_DEDICATED      0x3     // Memory which is not conventional memory (eg devices)
+#define INFO_MEM_SHARED         0x4     // Memory shared with another kernel / OS
+#define INFO_MEM_BOOTLOADER     0xE     // Bootloader specific memory (subtype = type)
+#define INFO_MEM_ARCH           0xF     // Architecture specific memory (subtype = type)
+
+// A memory descriptor in the information page
+//  low  = first address | virtual flag << 9 | subtype << 4 | type
+//  high = last address (low 10 bits ignored)
+typedef struct InfoMemDesc
+{
+    uint64_t    low;
+    uint64_t    high;
+
+} InfoMemDesc;
 
 // The fields stored in the information page
 //  All pointers are relative to the base address of this page
@@ -39,15 +63,16 @@ typedef struct
 
     char        kernExtra[0x60];// Extra kernel info (must end with 2 null chars)
 
-    uint64_t    clock;          // The value of the system clock
+    uint64_t    clockBase;      // Time stamp counter value when the system clock was 0
     uint32_t    memNumber;      // Number of memory descriptors
     uint32_t    memPtr;         // Pointer to first memory descriptor
-    char        unused2[0x50];
+    uint64_t    clockMult;      // Microseconds per time stamp counter tick (32.32 fixed point)
+    char        unused2[0xA0];
 
     uint64_t    utcbInfo;       // Info about the UTCB structure
     uint64_t    kipSize;        // Size (log 2) of kernel information page
 
-    char        unused3[0x10];
+    char        unused3[0x08];
     uint64_t    bootInfo;       // Extra boot information
     uint64_t    procDescPtr;    // Pointer to list of processor descriptors
 
@@ -69,8 +94,22 @@ typedef struct
     uint64_t    scSchedule;
     uint64_t    unused4;
 
+    // System call code (copied with the system call links)
+    char        syscallCode[0xE00 - INFO_MAX_MEM_DESC * sizeof(InfoMemDesc)];
+
+    // Memory descriptors (pointed to by memPtr)
+    InfoMemDesc memDesc[INFO_MAX_MEM_DESC];
+
 } InfoPageType;
 
+// Fields read by the system call code (see usersyscalls.s)
+STATIC_ASSERT(offsetof(InfoPageType, clockBase) == 0xA0);
+STATIC_ASSERT(offsetof(InfoPageType, clockMult) == 0xB0);
+
+// InfoPageInit adds every physical memory region after the undefined descriptor
+STATIC_ASSERT(INFO_MAX_MEM_DESC >= KMEM_MAX_REGIONS + 1);
+STATIC_ASSERT(sizeof(InfoPageType) == 0x1000);
+
 // The global information page
 extern InfoPageType InfoPage;
 
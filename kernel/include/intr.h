@@ -99,8 +99,16 @@ typedef struct IntrIdtPtrType
 #define INTR_IRQ            32      // Hardware Interrupt
 
 #define INTR_APIC_TIMER     240     // APIC Local Timer
+#define INTR_APIC_SHOOTDOWN 241     // TLB Shootdown IPI
+#define INTR_APIC_RESCHEDULE 242    // Cross cpu IPC / reschedule IPI
 #define INTR_APIC_SPURIOUS  255     // APIC Spurious Interrupt
 
+// Page fault error code bits
+#define INTR_PF_PRESENT     0x01    // Protection violation (otherwise page not present)
+#define INTR_PF_WRITE       0x02    // Write access
+#define INTR_PF_USER        0x04    // Fault from user mode
+#define INTR_PF_FETCH       0x10    // Instruction fetch
+
 // IO APIC registers
 #define INTR_IOAPIC_ID      0x00
 #define INTR_IOAPIC_VER     0x01
@@ -131,4 +139,7 @@ void IntrInitSetOverride(uint8_t isaIrq, uint32_t apicIrq, uint8_t flags);
 // Interrupt handler entry point
 void IntrHandler(IntrContext context);
 
+// Page fault handler entry point
+void IntrPageFault(IntrContext context);
+
 #endif
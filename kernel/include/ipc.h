@@ -0,0 +1,148 @@
+#ifndef KERNEL_IPC_H
+#define KERNEL_IPC_H
+
+/*
+ * kernel/include/ipc.h
+ * Inter-process communication
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "syscall.h"
+#include "thread.h"
+
+// Message tag (MR0) fields
+//  Bits 63-16 = label
+//  Bits 15-12 = flags
+//  Bits 11-6  = number of typed words (t)
+//  Bits  5-0  = number of untyped words (u)
+#define IPC_TAG_U(tag)          ((uint32_t) (tag) & 0x3F)
+#define IPC_TAG_T(tag)          ((uint32_t) ((tag) >> 6) & 0x3F)
+#define IPC_TAG_LABEL(tag)      ((tag) >> 16)
+#define IPC_TAG_ERROR           0x8000  // Flag set in received tags if the IPC failed
+
+// Creates a message tag
+static inline uint64_t IpcTagCreate(uint64_t label, uint32_t u, uint32_t t)
+{
+    return (label << 16) | (t << 6) | u;
+}
+
+// Labels of messages generated by the kernel
+#define IPC_LABEL_PAGEFAULT     ((uint64_t) -2 << 4)    // Low 4 bits = access (MAP_RIGHT_)
+
+// Typed item types (first word of each item)
+#define IPC_ITEM_TYPE_MASK      0xE
+#define IPC_ITEM_MAP            0x8
+#define IPC_ITEM_GRANT          0xA
+#define IPC_ITEM_CONTINUE       0x1     // Another item follows this one
+
+// String items (and string buffers in the buffer registers)
+//  Word 0 bits 63-10 = length
+//  Word 0 bits  9-4  = number of substrings - 1 (only simple strings are supported)
+//  Word 0 bit   3    = clear for strings (bits 2-1 are cache hints)
+//  Word 1            = address
+#define IPC_ITEM_STRING_MASK    0x8
+#define IPC_ITEM_STRING         0x0
+#define IPC_STRING_LENGTH(item)     ((item) >> 10)
+#define IPC_STRING_SUBSTRINGS(item) ((uint32_t) ((item) >> 4) & 0x3F)
+
+// Acceptor (BR0) fields
+//  Bits 63-4 = receive window for mappings (fpage without rights)
+//  Bit  0    = string items are accepted into the buffers in BR1 onwards
+#define IPC_ACCEPT_STRINGS      0x1
+
+// Error codes (ErrorCode >> 1, bit 0 is set for errors in the receive phase)
+#define IPC_ERROR_TIMEOUT       1
+#define IPC_ERROR_NOT_EXIST     2
+#define IPC_ERROR_CANCELED      3
+#define IPC_ERROR_OVERFLOW      4
+#define IPC_ERROR_XFER_INVOKER  5       // A string page was missing in the thread's own space
+#define IPC_ERROR_XFER_PARTNER  6       // A string page was missing in the partner's space
+
+// Flags for IpcOperation
+#define IPC_SEND                0x1     // Do send phase
+#define IPC_SEND_BLOCK          0x2     // Wait for the receiver to be ready
+#define IPC_RECEIVE             0x4     // Do receive phase
+#define IPC_RECEIVE_BLOCK       0x8     // Wait for a message to arrive
+#define IPC_CALL                (IPC_SEND | IPC_SEND_BLOCK | IPC_RECEIVE | IPC_RECEIVE_BLOCK)
+
+// Sends a message to a thread (if IPC_SEND), then receives a message (if IPC_RECEIVE)
+//  from = thread to receive from (NULL = any thread)
+//  timeouts = send timeout in bits 31-16, receive timeout in bits 15-0 (used by the
+//             phases which block, 0 = infinite)
+//  If the receive phase blocks, the thread sent to is run immediately
+//  Returns false on error (with the error in thread->errorCode)
+bool IpcOperation(Thread * thread, Thread * to, Thread * from, uint32_t flags, uint32_t timeouts);
+
+// Sends a message to another thread and waits for its reply
+static inline bool IpcCall(Thread * thread, Thread * to)
+{
+    return IpcOperation(thread, to, to, IPC_CALL, 0);
+}
+
+// Sets a thread up to wait for a message from another thread (NULL = any thread)
+//  The caller then puts it in THREAD_STATE_RECEIVING
+//  Closed waits are added to from->receivers so they can be aborted if from is deleted
+void IpcWaitFrom(Thread * thread, Thread * from);
+
+// Aborts all IPC involving a thread on the current cpu (before it is deleted)
+//  Threads sending to it fail with IPC_ERROR_CANCELED
+//  Returns false (and does nothing) if the thread is sending to another cpu
+bool IpcCancel(Thread * thread);
+
+// Removes a deleted thread from the IPC state of every cpu and then frees it
+//  Threads in a closed receive from it fail with IPC_ERROR_CANCELED
+//  The thread is freed (ThreadFree) after a request has visited every cpu, so any
+//  pointer from an earlier ThreadLookup has been dropped by then
+void IpcDelete(Thread * thread);
+
+// Ends the IPC wait of a thread with IPC_ERROR_TIMEOUT
+//  Handler of thread->timeout
+//  Receive timeouts run on the waiting thread's cpu, send timeouts on the receiver's cpu
+void IpcTimeout(TimeEvent * event);
+
+// Prepares a runnable thread on the current cpu to move to another cpu
+//  The timeouts of threads sending to it are cancelled (their sends carry on)
+void IpcMigrate(Thread * thread);
+
+// Handles IPC requests sent to this cpu by other cpus
+//  Called from the reschedule IPI, the timer interrupt and the idle loop
+void IpcMailboxProcess(void);
+
+// Sends a page fault message to a thread's pager and waits for the reply
+//  access = type of access which caused the fault (MAP_RIGHT_)
+//  Mappings in the reply are installed before this returns
+//  If there's no pager or the IPC fails, the thread is stopped (THREAD_STATE_INACTIVE)
+void IpcPageFault(Thread * thread, uint64_t addr, uint64_t ip, uint32_t access);
+
+// Ipc system call
+//  rdi = destination thread id (nil = no send phase)
+//  rsi = from specifier (nil = no receive phase, any = any thread)
+//  rdx = timeouts (send timeout in bits 31-16, receive timeout in bits 15-0)
+//  r10 = MR0 (the other message registers are in memory)
+//  Returns the thread the message was received from in rax and MR0 in rdx
+SyscallResult IpcSyscall(uint64_t toId, uint64_t fromId, uint64_t timeouts,
+                            uint64_t tag, uint64_t a5, uint64_t a6);
+
+// Lipc system call
+//  Same arguments as Ipc, except the threads are given by their local ids and must be
+//  in the caller's address space (a sender in the same space is returned by local id)
+//  Messages with only untyped words are switched directly, everything else is done like Ipc
+SyscallResult IpcLocalSyscall(uint64_t toId, uint64_t fromId, uint64_t timeouts,
+                                uint64_t tag, uint64_t a5, uint64_t a6);
+
+#endif
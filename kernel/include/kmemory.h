@@ -24,25 +24,173 @@
 #include "global.h"
 #include "multiboot.h"
 
-// Returns a pointer which can be used to access the first 4GB of physical memory
-static inline void * KMemFromPhysical(uint32_t pAddr)
+// Base of the region of virtual memory mapping all physical memory
+#ifdef CONFIG_HOSTBENCH
+# define KMEM_PHYSICAL_BASE     0x300000000000
+#else
+# define KMEM_PHYSICAL_BASE     0xFFFFFF8000000000
+#endif
+
+// Physical memory mapped by the boot paging tables (always accessible)
+#define KMEM_BOOT_MAP_END       0x100000000
+
+// Maximum size of the direct map (the kernel image is mapped above this)
+#define KMEM_DIRECT_MAP_MAX     0x7F80000000
+
+// Returns a pointer which can be used to access physical memory
+//  Only memory below KMEM_BOOT_MAP_END can be accessed before MemInitDirectMap
+static inline void * KMemFromPhysical(uint64_t pAddr)
 {
     // FFFF FF80 0000 0000
-    return (void *) (0xFFFFFF8000000000 + pAddr);
+    return (void *) (KMEM_PHYSICAL_BASE + pAddr);
 }
 
-// Initializes the kernel memory manager using the given region of memory
-//  The base address is a physical address
-//  The base address and length must be page aligned
-void KMemInit(uint32_t base, uint32_t length);
+// Returns the physical address of a pointer returned by KMemFromPhysical
+static inline uint64_t KMemToPhysical(void * ptr)
+{
+    return (uint64_t) ptr - KMEM_PHYSICAL_BASE;
+}
+
+// Orders of the blocks which can be allocated (block size = 4KB << order)
+#define KMEM_ORDER_4KB          0
+#define KMEM_ORDER_2MB          9
+#define KMEM_MAX_ORDER          KMEM_ORDER_2MB
+
+// Maximum number of NUMA nodes
+#define KMEM_MAX_NODES          16
+
+// Number of pages each cpu can hold in its page cache
+#define KMEM_CPU_CACHE_SIZE     64
+
+// Number of pages moved between a cpu cache and the global allocator at once
+#define KMEM_CPU_CACHE_BATCH    32
+
+// Number of pre-zeroed pages idle cpus try to keep available
+#define KMEM_ZERO_POOL_SIZE     256
+
+// Per-cpu cache of free pages (stored in the Cpu structure)
+//  Pages in the cache are owned by that cpu and can be used without locking
+typedef struct KMemCpuCache
+{
+    uint32_t count;                         // Number of pages in the cache
+    void * pages[KMEM_CPU_CACHE_SIZE];      // Cached pages (used as a stack)
+
+    uint64_t allocations;                   // Blocks allocated by this cpu
+    uint64_t frees;                         // Blocks freed by this cpu
+    uint64_t lockSpins;                     // Spins waiting for allocator locks
+    uint64_t zeroHits;                      // KMemZAllocate calls served by the zero pool
+    uint64_t zeroMisses;                    // KMemZAllocate calls which zeroed a page
+
+} KMemCpuCache;
+
+// Allocator statistics returned by KMemGetStats
+//  All counts are in pages unless stated otherwise
+typedef struct KMemStats
+{
+    uint64_t totalPages;                    // Pages managed by the allocator
+    uint64_t freePages;                     // Pages in the node free lists
+    uint64_t cachedPages;                   // Free pages held in the per-cpu caches
+    uint64_t zeroPages;                     // Pages in the pre-zeroed pool
+    uint64_t peakUsedPages;                 // Sum of each node's highest number of used pages
+
+    uint64_t allocations;                   // Number of blocks allocated
+    uint64_t frees;                         // Number of blocks freed
+    uint64_t lockSpins;                     // Spins waiting for allocator locks
+    uint64_t zeroHits;                      // KMemZAllocate calls served by the zero pool
+    uint64_t zeroMisses;                    // KMemZAllocate calls which zeroed a page
+
+} KMemStats;
+
+// Function called for each block by KMemDumpAllocations
+typedef void (* KMemDumpCallback)(void * block, uint32_t order, void * caller);
+
+// Maximum number of physical memory regions
+#define KMEM_MAX_REGIONS        64
+
+// Physical memory region types
+#define KMEM_REGION_USABLE      1   // RAM managed by the allocator
+#define KMEM_REGION_RESERVED    2   // Memory reserved by the firmware
+#define KMEM_REGION_KERNEL      3   // Memory used by the kernel image or boot data
+
+// A region of physical memory [base, end)
+typedef struct KMemRegion
+{
+    uint64_t base;
+    uint64_t end;
+    uint32_t type;          // One of the KMEM_REGION constants
+    uint32_t firmwareType;  // Multiboot type of reserved regions
+
+} KMemRegion;
+
+// Sorted list of all the physical memory regions in the system
+extern KMemRegion KMemRegions[KMEM_MAX_REGIONS];
+extern uint32_t KMemRegionCount;
+
+// End of the highest physical memory region (limited to KMEM_DIRECT_MAP_MAX)
+extern uint64_t KMemPhysicalEnd;
+
+// Number of NUMA nodes (1 on non-NUMA systems)
+extern uint32_t KMemNodeCount;
+
+// Assigns the memory in [base, end) to the given NUMA node
+//  Must be called before KMemInit. Memory not assigned to a node is in node 0
+void KMemAddNodeRange(uint64_t base, uint64_t end, uint32_t node);
+
+// Sets the relative distance between two NUMA nodes (10 = local)
+//  Must be called before KMemInit
+void KMemSetNodeDistance(uint32_t from, uint32_t to, uint8_t distance);
+
+// Initializes the kernel memory manager using the multiboot memory map
+//  All usable memory below KMEM_BOOT_MAP_END not used by the kernel or boot data
+//  is given to the allocator
+void KMemInit(MultibootInfo * bootInfo);
+
+// Gives all the usable memory above KMEM_BOOT_MAP_END to the allocator
+//  The direct map must cover all of memory first (MemInitDirectMap)
+void KMemInitHigh(void);
 
 // Allocates 1 page of kernel memory
 //  ZAllocate zeros the page before returning it
-//  Returns NULL if out of memory
+//  Returns NULL if out of memory (the zero pool is used up before giving up)
 void * KMemAllocate(void);
 void * KMemZAllocate(void);
 
 // Frees 1 page of kernel memory
 void KMemFree(void * page);
 
+// Zeros one page and adds it to the pre-zeroed page pool if the pool isn't full
+//  Called by idle cpus. Returns false if there was nothing to do
+bool KMemZeroIdle(void);
+
+// Gets the current allocator statistics
+//  The counters are read without locking so they may be slightly inconsistent
+//  Pages in the per-cpu caches and the zero pool count as used by their node
+void KMemGetStats(KMemStats * stats);
+
+#ifdef CONFIG_KMEM_DEBUG
+// Calls the callback for every block which has been allocated but not freed
+//  Pages zeroed by idle cpus are reported as allocated by the caller of KMemZeroIdle
+void KMemDumpAllocations(KMemDumpCallback callback);
+#endif
+
+// Allocates a physically contiguous block of 2^order pages
+//  The block is aligned to its size
+//  Returns NULL if out of memory (the zero pool is used up before giving up)
+void * KMemAllocateOrder(uint32_t order);
+
+// Allocates a block of 2^order pages, preferring memory from the given node
+//  KMemAllocateOrder prefers the current cpu's node
+void * KMemAllocateOrderNode(uint32_t order, uint32_t node);
+
+// Frees a block allocated with KMemAllocateOrder
+//  The order must be the same as the one used to allocate it
+void KMemFreeOrder(void * block, uint32_t order);
+
+// Initializes an empty per-cpu page cache
+void KMemCpuCacheInit(KMemCpuCache * cache);
+
+// Starts using the per-cpu page caches
+//  Must be called after all the cpus have been added to CpuList
+void KMemCpuCacheEnable(void);
+
 #endif
@@ -57,7 +57,7 @@ static inline void ListAddBefore(ListNode * node, ListNode * newNode)
     newNode->next = node;
     newNode->prev = node->prev;
     node->prev->next = newNode;
-    node->prev = node;
+    node->prev = newNode;
 }
 
 // Adds an item after the given node
@@ -66,7 +66,7 @@ static inline void ListAddAfter(ListNode * node, ListNode * newNode)
     newNode->prev = node;
     newNode->next = node->next;
     node->next->prev = newNode;
-    node->next = node;
+    node->next = newNode;
 }
 
 // Adds an item at the beginning of the list
@@ -92,7 +92,7 @@ static inline void ListDelete(ListNode * node)
 
 // Gets the structure from a list node
 #define ListGet(node, type, member) \
-    (type *) ((char *) (node) - offsetof((type), (member)))
+    ((type *) ((char *) (node) - offsetof(type, member)))
 
 // Iterates over the given list using var as the loop counter variable
 //  The type of objects are infered from the type of var
@@ -104,9 +104,9 @@ static inline void ListDelete(ListNode * node)
 // Iterates over the given list safely (you can modify the list while iterating)
 //  The temporary variable supplied is created in the loop
 #define ListForEachSafe(var, tmp, list, member) \
-    for(var = ListGet((list)->sentinal.next, typeof(*(var)), member), \
-        typeof(var) tmp = ListGet(var->member.next, typeof(*(var)), member); \
-        &var->member != (list); \
+    for(typeof(var) tmp = (var = ListGet((list)->sentinal.next, typeof(*(var)), member), \
+            ListGet((var)->member.next, typeof(*(var)), member)); \
+        &(var)->member != &(list)->sentinal; \
         var = tmp, tmp = ListGet(tmp->member.next, typeof(*(var)), member))
 
 #endif
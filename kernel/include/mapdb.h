@@ -0,0 +1,111 @@
+#ifndef KERNEL_MAPDB_H
+#define KERNEL_MAPDB_H
+
+/*
+ * kernel/include/mapdb.h
+ * Mapping database (tracks where every mapping was derived from)
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "memory.h"
+
+// Fpage access rights
+#define MAP_RIGHT_X         0x1
+#define MAP_RIGHT_W         0x2
+#define MAP_RIGHT_R         0x4
+#define MAP_RIGHTS_ALL      0x7
+
+// Special fpages
+#define MAP_FPAGE_NIL       0x0
+#define MAP_FPAGE_COMPLETE  0x10
+
+// A flexpage (L4 X.2 format)
+//  Bits 63-10 = base / 1024
+//  Bits  9-4  = log2 of the size
+//  Bits  2-0  = access rights
+typedef uint64_t MapFpage;
+
+// Creates an fpage
+static inline MapFpage MapFpageCreate(uint64_t base, uint32_t sizeLog2, uint32_t rights)
+{
+    return (base & ~0x3FFUL) | (sizeLog2 << 4) | rights;
+}
+
+// Returns the log2 of the size of an fpage
+static inline uint32_t MapFpageSizeLog2(MapFpage fpage)
+{
+    return (fpage >> 4) & 0x3F;
+}
+
+// Returns the base address of an fpage (aligned to its size)
+static inline uint64_t MapFpageBase(MapFpage fpage)
+{
+    uint32_t sizeLog2 = MapFpageSizeLog2(fpage);
+
+    if (sizeLog2 >= 64)
+        return 0;
+
+    return fpage & ~0x3FFUL & ~((1UL << sizeLog2) - 1);
+}
+
+// Returns the access rights of an fpage
+static inline uint32_t MapFpageRights(MapFpage fpage)
+{
+    return fpage & MAP_RIGHTS_ALL;
+}
+
+// A node in the mapping database (one cache line)
+//  Each node is one mapped page (4KB or 2MB). The children of a node are the
+//  mappings derived from it
+typedef struct MapNode
+{
+    struct MapNode * parent;        // Mapping this was derived from (NULL for roots)
+    struct MapNode * firstChild;    // First mapping derived from this one
+    struct MapNode * prevSibling;   // Siblings (other children of the parent)
+    struct MapNode * nextSibling;
+
+    MemSpace * space;               // Address space containing the mapping
+    uint64_t vAddr;                 // Virtual address of the page
+    uint64_t pAddr;                 // Physical address of the page
+    uint32_t sizeLog2;              // Log2 of the page size
+    uint32_t rights;                // Access rights (MAP_RIGHT_)
+
+} ALIGN(64) MapNode;
+
+// Initializes the mapping database
+//  Must be called after CpuInitAll
+void MapInit(void);
+
+// Maps physical memory into an address space as the root of new mapping trees
+//  Used to give sigma0 all of memory. Returns false if out of memory
+bool MapRoot(MemSpace * space, uint64_t vAddr, uint64_t pAddr, uint64_t size, uint32_t rights);
+
+// Maps (or grants) an fpage from one address space into another
+//  sendBase selects which part of the larger fpage is used if the sizes are different
+//  Existing mappings in the destination are replaced
+//  Returns false if out of memory (part of the fpage may have been mapped)
+bool MapFpageSend(MemSpace * from, MapFpage sendFpage, uint64_t sendBase,
+                    MemSpace * to, MapFpage recvWindow, bool grant);
+
+// Revokes the rights in the fpage from all mappings derived from the fpage in the given space
+//  If flush is true, the rights are also revoked from the space's own mappings
+//  Mappings which lose read access are removed
+//  Pages are always revoked entirely (a 2MB page is revoked if any part of it is in the fpage)
+void MapUnmap(MemSpace * space, MapFpage fpage, bool flush);
+
+#endif
@@ -22,6 +22,169 @@
  */
 
 #include "global.h"
+#include "atomic.h"
+#include "list.h"
+
+// Page table entry flags
+#define MEM_PAGE_PRESENT    0x001
+#define MEM_PAGE_WRITABLE   0x002
+#define MEM_PAGE_USER       0x004
+#define MEM_PAGE_LARGE      0x080   // 2MB / 1GB page
+#define MEM_PAGE_GLOBAL     0x100
+#define MEM_PAGE_NX         0x8000000000000000
+#define MEM_PAGE_ADDR_MASK  0x000FFFFFFFFFF000
+
+// End of the user half of every address space
+#define MEM_USER_END        0x0000800000000000
+
+// End of the user memory which can be mapped
+//  The last page is never mapped so a syscall can't return to the non-canonical
+//  MEM_USER_END (see EntrySyscall)
+#define MEM_USER_MAP_END    (MEM_USER_END - 0x1000)
+
+// Page sizes which can be mapped into address spaces
+#define MEM_PAGE_4KB        0x1000
+#define MEM_PAGE_2MB        0x200000
+
+// Number of PCIDs each cpu shares between address spaces
+//  PCID 0 is used by the kernel tables
+#define MEM_PCID_COUNT      16
+
+// Number of words in the mask of cpus using an address space (1 bit per cpu id)
+#define MEM_CPU_MASK_WORDS  4
+
+// Number of TLB shootdown requests each cpu can queue (the whole TLB is flushed on overflow)
+#define MEM_SHOOTDOWN_QUEUE 8
+
+// Number of address spaces a batch can flush separately (every TLB is flushed on overflow)
+#define MEM_BATCH_SPACES    8
+
+// An address space
+//  The user half is private and the kernel half is shared by all address spaces
+typedef struct MemSpace
+{
+    uint64_t * pml4;        // PML4 table (in the direct map)
+    AtomicSpinlock lock;    // Lock protecting the user page tables
+
+    uint64_t id;            // Unique id of this address space (never reused)
+    volatile uint64_t tlbGen;   // Incremented whenever a mapping is changed or removed
+
+    volatile uint64_t cpuMask[MEM_CPU_MASK_WORDS];  // Cpus currently using this address space
+
+    List threads;           // Threads in this address space (managed by thread.c)
+
+} MemSpace;
+
+// A range of an address space which another cpu must flush from its TLB
+typedef struct MemShootdown
+{
+    MemSpace * space;
+    uint64_t start;
+    uint64_t end;
+    uint64_t gen;           // tlbGen after the change (0 if several changes were merged)
+
+} MemShootdown;
+
+// A set of page table changes whose TLB flushes are done together
+//  The mapping database changes pages with its lock held, and flushing then would
+//  deadlock with a cpu spinning on the lock (interrupts are disabled in the kernel),
+//  so the flushes and the freeing of page tables wait until MemBatchFinish
+typedef struct MemBatch
+{
+    uint32_t count;                         // Number of ranges
+    bool flushAll;                          // Too many spaces changed, flush every TLB
+    MemShootdown ranges[MEM_BATCH_SPACES];  // Range to flush in each changed space
+    void * freeTables;                      // Page tables to free after the flush
+    void * freeDataTables;                  // Page tables with data pointers to free
+
+} MemBatch;
+
+// Per-cpu address space state (stored in the Cpu structure)
+//  Each cpu assigns its PCIDs to the address spaces it runs most recently
+typedef struct MemCpuState
+{
+    uint64_t pcidSpace[MEM_PCID_COUNT];     // Id of the address space using each PCID
+    uint64_t pcidGen[MEM_PCID_COUNT];       // tlbGen of the space when its entries were last valid
+    uint32_t pcidNext;                      // Next PCID to recycle
+    MemSpace * current;                     // Address space this cpu is using
+
+    AtomicSpinlock shootLock;               // Lock protecting the shootdown queue
+    uint32_t shootCount;                    // Number of queued shootdowns
+    bool shootOverflow;                     // True if the queue overflowed
+    uint64_t shootQueued;                   // Number of shootdowns queued on this cpu
+    volatile uint64_t shootDone;            // Value of shootQueued when the queue was last emptied
+    MemShootdown shootQueue[MEM_SHOOTDOWN_QUEUE];
+
+} MemCpuState;
+
+// Initializes the current cpu's address space state
+//  Enables PCIDs if the cpu supports them
+void MemInitCpu(MemCpuState * state);
+
+// Creates a new address space containing only the kernel mappings
+//  Returns false if out of memory
+bool MemSpaceInit(MemSpace * space);
+
+// Frees all the page tables owned by an address space
+//  4KB pages mapped by MemSpaceMap (without a data pointer) are freed too
+//  The address space must not be active on any cpu
+void MemSpaceDestroy(MemSpace * space);
+
+// Starts an empty batch of page table changes
+void MemBatchInit(MemBatch * batch);
+
+// Flushes the changes in a batch from every cpu's TLB and frees the old page tables
+//  Must be called without holding any locks (other cpus may need to take them before they can respond)
+void MemBatchFinish(MemBatch * batch);
+
+// Maps size bytes of physical memory at pAddr to vAddr in an address space
+//  flags is a combination of MEM_PAGE_ flags (PRESENT is always added)
+//  2MB pages are used wherever both addresses are aligned to 2MB
+//  Any existing mappings in the range are replaced
+//  Returns false if out of memory (part of the range may have been mapped)
+//  4KB pages mapped this way belong to the space (MemSpaceDestroy frees them with KMemFree)
+bool MemSpaceMap(MemSpace * space, uint64_t vAddr, uint64_t pAddr, uint64_t size, uint64_t flags);
+
+// Maps memory like MemSpaceMap and stores a data pointer with each page
+//  Used by the mapping database to find the mapping node of a page
+//  Replaced mappings are flushed by MemBatchFinish (or before returning if batch is NULL)
+bool MemSpaceMapData(MemSpace * space, uint64_t vAddr, uint64_t pAddr,
+                        uint64_t size, uint64_t flags, void * data, MemBatch * batch);
+
+// Returns the data pointer stored with the page containing vAddr (or NULL)
+//  size is set to the size of the page, or of the unmapped region around vAddr
+void * MemSpaceGetData(MemSpace * space, uint64_t vAddr, uint64_t * size);
+
+// Unmaps size bytes from vAddr in an address space
+//  Page tables covered by the range are freed
+//  The range is flushed from every cpu using the address space by MemBatchFinish (or
+//  before returning if batch is NULL)
+//  If a 2MB page can't be split because memory is low, the whole page is unmapped
+void MemSpaceUnmap(MemSpace * space, uint64_t vAddr, uint64_t size, MemBatch * batch);
+
+// Finds the physical address and flags a virtual address is mapped to
+//  Returns false if the address is not mapped
+//  Unless the space is locked (MemSpaceLockPair), the page may be unmapped at any time
+bool MemSpaceLookup(MemSpace * space, uint64_t vAddr, uint64_t * pAddr, uint64_t * flags);
+
+// Locks the page tables of two address spaces (which may be the same)
+//  Pages found with MemSpaceLookup stay mapped, and their page tables allocated, until
+//  MemSpaceUnlockPair is called
+void MemSpaceLockPair(MemSpace * a, MemSpace * b);
+void MemSpaceUnlockPair(MemSpace * a, MemSpace * b);
+
+// Flushes the TLB entries other cpus have asked this cpu to flush
+//  Called by the TLB shootdown IPI handler
+void MemShootdownHandler(void);
+
+// Switches the current cpu to the given address space
+//  With PCIDs, the space's TLB entries are kept if it still has a valid PCID on this cpu
+void MemSpaceSwitch(MemSpace * space);
+
+// Extends the direct map (KMemFromPhysical) to cover physical memory up to end
+//  Uses 1GB pages if the cpu supports them
+//  Must be called before MemEnableGlobalPages
+void MemInitDirectMap(uint64_t end);
 
 // Enables the global bit on all kernel pages and unmaps the lower boot region
 void MemEnableGlobalPages(void);
@@ -0,0 +1,148 @@
+#ifndef KERNEL_SCHED_H
+#define KERNEL_SCHED_H
+
+/*
+ * kernel/include/sched.h
+ * Thread scheduler
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "list.h"
+#include "syscall.h"
+#include "time.h"
+
+struct Cpu;
+struct Thread;
+
+// Number of priorities (higher priorities run first)
+#define SCHED_PRIORITIES        256
+
+// Number of words in the priority bitmap
+#define SCHED_BITMAP_WORDS      (SCHED_PRIORITIES / 64)
+
+// Length of a timeslice (in microseconds)
+#define SCHED_TIMESLICE         10000
+
+// Requests sent between cpus (ThreadMail types, see SchedMailHandle)
+#define SCHED_MAIL_FIRST        0x10
+#define SCHED_MAIL_MIGRATE      0x10    // The thread has moved to this cpu
+#define SCHED_MAIL_STEAL        0x11    // Send a thread to the cpu of the idle thread posting this
+#define SCHED_MAIL_STEAL_DONE   0x12    // A steal request has been handled
+
+// Thread states returned by the Schedule system call
+#define SCHED_RESULT_ERROR      0
+#define SCHED_RESULT_DEAD       1
+#define SCHED_RESULT_INACTIVE   2
+#define SCHED_RESULT_RUNNING    3
+#define SCHED_RESULT_SEND_WAIT  4   // Waiting to send
+#define SCHED_RESULT_RECV_WAIT  6   // Waiting to receive
+
+// Schedule error codes
+#define SCHED_ERROR_NO_PRIVILEGE    1
+#define SCHED_ERROR_UNAVAILABLE     2
+#define SCHED_ERROR_INVALID_PARAM   5
+
+// Per-cpu run queues (stored in the Cpu structure)
+//  Queues are updated lazily so IPC between threads usually needs no queue operations
+//  - Runnable threads other than the current thread are always queued
+//  - Threads stay queued while they run, except threads IPC switched to directly
+//    (which are queued if they are preempted)
+//  - Threads which block stay queued until SchedNext finds them
+//  Only the owning cpu touches its queues, so no locks are needed (other cpus post
+//  requests to the cpu's mailbox)
+//
+//  There is no periodic tick. The timeslice event is only added when other threads
+//  are waiting to run, so idle cpus are never interrupted by it
+//
+//  Cpus with fewer threads steal threads from busier cpus, preferring cpus in the same
+//  core, then package, then NUMA node. The request is posted to the busy cpu, which
+//  picks a thread and posts it back. Busy cpus also wake idle cpus at the end of
+//  each timeslice so they can steal
+typedef struct SchedCpuState
+{
+    uint64_t summary;                       // Bit i set if bitmap[i] is not 0
+    uint64_t bitmap[SCHED_BITMAP_WORDS];    // Bit set for each non-empty queue
+    List * queues;                          // Queue for each priority (one page)
+
+    volatile uint32_t load;                 // Number of queued threads (read by other cpus)
+    TimeEvent sliceEvent;                   // Ends the current timeslice (if pending)
+    bool sliceOver;                         // The timeslice ended (handled by SchedTimer)
+    bool stealing;                          // A steal request has been posted
+
+} SchedCpuState;
+
+// Allocates a cpu's run queues
+void SchedInitCpu(struct Cpu * cpu);
+
+// Adds a runnable thread on the current cpu to the end of its queue (if not queued)
+void SchedAdd(struct Thread * thread);
+
+// Removes a thread from the current cpu's run queues (if queued)
+void SchedRemove(struct Thread * thread);
+
+// Returns the highest priority runnable thread (or the idle thread)
+//  The thread stays queued. Blocked threads found on the way are removed
+struct Thread * SchedNext(void);
+
+// Runs a higher priority thread if one is runnable
+//  The current thread keeps its place (or goes to the front of its queue)
+void SchedPreempt(void);
+
+// Switches to a thread chosen by the scheduler and starts its timeslice
+void SchedSwitch(struct Thread * next);
+
+// Moves the current thread to the end of its queue and runs the next thread
+void SchedYield(void);
+
+// Switches threads after the timer events have run (called by the timer interrupt)
+//  Ends the timeslice if it's over, otherwise runs threads woken by timeouts if they
+//  have a higher priority
+void SchedTimer(void);
+
+// Changes the priority of a thread on the current cpu
+void SchedSetPriority(struct Thread * thread, uint8_t priority);
+
+// Binds a thread on the current cpu to a cpu (NULL = any cpu)
+//  Queued threads move immediately, others move the next time they are woken
+void SchedSetAffinity(struct Thread * thread, struct Cpu * cpu);
+
+// Tries to steal a thread from a busier cpu
+//  Called by idle cpus when they wake up and by busy cpus at the end of each timeslice
+void SchedBalance(void);
+
+// Handles a SCHED_MAIL_ request posted to this cpu by a thread
+//  Called from IpcMailboxProcess
+void SchedMailHandle(struct Thread * thread);
+
+// ThreadSwitch system call
+//  rdi = thread to donate the rest of the timeslice to (nil = any thread)
+SyscallResult SchedThreadSwitchSyscall(uint64_t destId, uint64_t a2, uint64_t a3,
+                                        uint64_t a4, uint64_t a5, uint64_t a6);
+
+// Schedule system call
+//  rdi = thread to change
+//  rsi = time control (ignored)
+//  rdx = processor to bind the thread to (-1 = don't change)
+//  r10 = priority (-1 = don't change)
+//  r8  = preemption control (ignored)
+//  Only the thread's scheduler may change it, and not above its own priority
+//  Returns the thread's state (SCHED_RESULT_) in rax
+SyscallResult SchedScheduleSyscall(uint64_t destId, uint64_t timeControl, uint64_t procControl,
+                                    uint64_t prioControl, uint64_t preemptControl, uint64_t a6);
+
+#endif
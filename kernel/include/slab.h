@@ -0,0 +1,93 @@
+#ifndef KERNEL_SLAB_H
+#define KERNEL_SLAB_H
+
+/*
+ * kernel/include/slab.h
+ * Slab allocator for fixed size kernel objects
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "atomic.h"
+#include "list.h"
+
+// Size of a cache line (used for alignment and colouring)
+#define SLAB_CACHE_LINE         64
+
+// Number of objects each cpu can hold for each slab cache
+#define SLAB_CPU_CACHE_SIZE     14
+
+// Number of objects moved between a cpu cache and the slabs at once
+#define SLAB_CPU_CACHE_BATCH    7
+
+// Minimum number of objects in each slab (larger objects use multi-page slabs)
+#define SLAB_MIN_OBJECTS        8
+
+// Number of empty slabs kept by each cache before they are freed
+#define SLAB_MAX_EMPTY          1
+
+// Object constructor
+//  Called on every object when a new slab is created
+//  Objects must be in their constructed state when they are freed
+typedef void (* SlabConstructor)(void * object);
+
+// Per-cpu cache of free objects (2 cache lines)
+typedef struct SlabCpuCache
+{
+    uint64_t count;                         // Number of objects in the cache
+    void * objects[SLAB_CPU_CACHE_SIZE];    // Cached objects (used as a stack)
+
+} ALIGN(SLAB_CACHE_LINE) SlabCpuCache;
+
+// A cache of objects of one type
+typedef struct SlabCache
+{
+    uint32_t objSize;           // Size of each object (including the free link)
+    uint32_t linkOffset;        // Offset of the free list link within an object
+    uint32_t order;             // Order of the blocks used for slabs
+    uint32_t objsPerSlab;       // Number of objects in each slab
+    uint32_t firstOffset;       // Offset of the first object (without colouring)
+    uint32_t colourStep;        // Difference between each colour offset
+    uint32_t colourMax;         // Largest colour offset (unused space in each slab)
+    uint32_t colourNext;        // Colour offset of the next slab
+    SlabConstructor ctor;       // Object constructor (or NULL)
+
+    AtomicSpinlock lock;        // Lock protecting the slab lists
+    List partial;               // Slabs with some free objects
+    List full;                  // Slabs with no free objects
+    List empty;                 // Slabs with no used objects
+    uint32_t emptyCount;        // Number of slabs in the empty list
+
+    SlabCpuCache * cpuCaches;   // Per-cpu caches (indexed by cpu id)
+
+} SlabCache;
+
+// Initializes a new slab cache
+//  size  = size of each object
+//  align = alignment of each object (must be a power of 2 no larger than a page)
+//  ctor  = object constructor (or NULL)
+//  Must be called after CpuInitAll
+void SlabCacheInit(SlabCache * cache, uint32_t size, uint32_t align, SlabConstructor ctor);
+
+// Allocates an object from a slab cache
+//  Returns NULL if out of memory
+void * SlabAllocate(SlabCache * cache);
+
+// Frees an object to the cache it was allocated from
+void SlabFree(SlabCache * cache, void * object);
+
+#endif
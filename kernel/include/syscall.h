@@ -0,0 +1,66 @@
+#ifndef KERNEL_SYSCALL_H
+#define KERNEL_SYSCALL_H
+
+/*
+ * kernel/include/syscall.h
+ * System call dispatch
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+
+// System call numbers (passed in rax)
+//  These must match the stubs in usersyscalls.s
+#define SYSCALL_SPACE_CONTROL       0
+#define SYSCALL_THREAD_CONTROL      1
+#define SYSCALL_PROCESSOR_CONTROL   2
+#define SYSCALL_MEMORY_CONTROL      3
+#define SYSCALL_IPC                 4
+#define SYSCALL_LIPC                5
+#define SYSCALL_UNMAP               6
+#define SYSCALL_EXCHANGE_REGISTERS  7
+#define SYSCALL_THREAD_SWITCH       8
+#define SYSCALL_SCHEDULE            9
+#define SYSCALL_COUNT               10
+
+// Registers saved on the kernel stack by a system call
+//  The user's callee saved registers are preserved by the C code
+typedef struct SyscallFrame
+{
+    uint64_t rip;
+    uint64_t rflags;
+    uint64_t rsp;
+
+} SyscallFrame;
+
+// Value of rax and rdx returned to user mode
+typedef struct SyscallResult
+{
+    uint64_t rax;
+    uint64_t rdx;
+
+} SyscallResult;
+
+// A system call handler
+//  Arguments are passed in the same registers as normal functions (except rcx is in r10)
+typedef SyscallResult (* SyscallHandler)(uint64_t a1, uint64_t a2, uint64_t a3,
+                                            uint64_t a4, uint64_t a5, uint64_t a6);
+
+// Table of system call handlers (indexed by system call number)
+extern const SyscallHandler SyscallTable[SYSCALL_COUNT];
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef KERNEL_THREAD_H
+#define KERNEL_THREAD_H
+
+/*
+ * kernel/include/thread.h
+ * Threads and thread switching
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "cpu.h"
+#include "list.h"
+#include "memory.h"
+#include "syscall.h"
+#include "time.h"
+#include "utcb.h"
+
+// Size of a thread (the thread structure is at the bottom of its kernel stack)
+#define THREAD_SIZE             0x1000
+
+// Thread ids (L4 global thread ids)
+//  Bits 63-14 = thread number
+//  Bits 13-0  = version
+#define THREAD_ID_NIL           0
+#define THREAD_ID_ANY           ((uint64_t) -1)
+#define THREAD_ID_VERSION_BITS  14
+
+#define THREAD_ID_VERSION_MASK  ((1UL << THREAD_ID_VERSION_BITS) - 1)
+
+// Thread numbers (published in threadInfo in the info page)
+//  Numbers below THREAD_SYSTEM_BASE are interrupt threads, numbers below
+//  THREAD_USER_BASE are kernel threads and the rest are user threads
+#define THREAD_NUMBER_BITS      CONFIG_THREAD_BITS
+#define THREAD_TABLE_SIZE       (1UL << THREAD_NUMBER_BITS)
+#define THREAD_SYSTEM_BASE      256
+#define THREAD_USER_BASE        512
+
+// Priority given to new threads
+#define THREAD_DEFAULT_PRIORITY 100
+
+// ThreadControl error codes
+#define THREAD_ERROR_NO_PRIVILEGE       1
+#define THREAD_ERROR_UNAVAILABLE        2   // Thread id is invalid or the thread is busy
+#define THREAD_ERROR_INVALID_SPACE      3
+#define THREAD_ERROR_INVALID_SCHEDULER  4
+#define THREAD_ERROR_INVALID_PAGER      5
+#define THREAD_ERROR_INVALID_UTCB       6
+#define THREAD_ERROR_OUT_OF_MEMORY      8
+
+// Thread states
+#define THREAD_STATE_INACTIVE   0   // Not running (never resumed)
+#define THREAD_STATE_RUNNING    1   // Running or ready to run
+#define THREAD_STATE_SENDING    2   // Waiting to send a message to partner
+#define THREAD_STATE_CALLING    3   // Waiting to send to partner, then receive its reply
+#define THREAD_STATE_RECEIVING  4   // Waiting for a message from partner (NULL = any thread)
+
+// A request sent to the cpu a thread runs on (see ThreadMailPost)
+//  Each thread has one and only posts it once at a time
+typedef struct ThreadMail
+{
+    struct ThreadMail * next;       // Next (older) request in the mailbox
+    uint32_t type;                  // Request type (owned by the user of the request)
+    uint32_t flags;                 // Extra information about the request
+    uint64_t error;                 // Result of the request
+    uint64_t time;                  // Time the request gives up (0 = never)
+    struct Thread * target;         // Thread the request is about
+
+} ThreadMail;
+
+// A thread
+typedef struct Thread
+{
+    uint64_t kernelRsp;             // Saved kernel stack pointer (while switched out)
+    uint32_t state;                 // Thread state (THREAD_STATE_)
+    uint8_t priority;               // Scheduling priority (higher runs first)
+    ListNode runNode;               // Node in the cpu's run queue (NULL if not queued)
+    uint64_t id;                    // Global thread id
+    Cpu * cpu;                      // Cpu the thread runs on
+    Cpu * affinity;                 // Cpu the thread is bound to (NULL = any)
+
+    MemSpace * space;               // Address space the thread runs in (NULL = kernel only)
+    ListNode spaceNode;             // Node in the address space's list of threads
+    uint64_t pager;                 // Global id of the thread sent page fault messages
+    uint64_t scheduler;             // Global id of the thread allowed to change our priority
+
+    struct Thread * partner;        // IPC partner (depends on state)
+    List senders;                   // Threads waiting to send to this thread
+    ListNode sendNode;              // Node in the partner's senders list
+    List receivers;                 // Threads waiting to receive from only this thread (any cpu)
+    ListNode recvNode;              // Node in the partner's receivers list (NULL if not in one)
+    AtomicSpinlock receiversLock;   // Lock protecting receivers
+    uint64_t senderId;              // Global id of the sender of the last message received
+    ThreadMail mail;                // Request sent to other cpus for this thread
+    TimeEvent timeout;              // Ends the current IPC wait (if pending)
+    TimePeriod recvTimeout;         // Receive timeout used once a call's send phase ends
+
+    Utcb * utcb;                    // Virtual registers (through the direct map, NULL = none)
+    uint64_t localId;               // Address of the UTCB in the thread's space
+
+} Thread;
+
+// Table of threads indexed by thread number (THREAD_TABLE_SIZE entries)
+extern Thread ** ThreadTable;
+
+// Address space of the root server (threads running in it are privileged)
+extern MemSpace * ThreadRootSpace;
+
+// Returns the thread with the given global id (or NULL if it doesn't exist)
+//  This takes no locks. Threads are published in the table after being initialized
+static inline Thread * ThreadLookup(uint64_t id)
+{
+    uint64_t number = id >> THREAD_ID_VERSION_BITS;
+
+    if (UNLIKELY(number >= THREAD_TABLE_SIZE))
+        return NULL;
+
+    Thread * thread = ThreadTable[number];
+
+    if (UNLIKELY(thread == NULL || thread->id != id))
+        return NULL;
+
+    return thread;
+}
+
+// Returns the thread in an address space with a local id (UTCB address), or NULL
+//  Like ThreadLookup, the thread can only be used until the caller next blocks
+Thread * ThreadLookupLocal(MemSpace * space, uint64_t localId);
+
+// Returns the top of a thread's kernel stack
+static inline uint64_t ThreadStackTop(Thread * thread)
+{
+    return (uint64_t) thread + THREAD_SIZE;
+}
+
+// Returns the thread running on this cpu
+static inline Thread * ThreadCurrent(void)
+{
+    return CpuCurrent()->thread;
+}
+
+// Returns true if a thread is allowed to use privileged system calls
+static inline bool ThreadIsPrivileged(Thread * thread)
+{
+    return thread->space != NULL && thread->space == ThreadRootSpace;
+}
+
+// Allocates the thread table and the caches used for threads
+//  Must be called after CpuInitAll
+void ThreadInit(void);
+
+// Creates the idle thread for a cpu (which becomes the current thread)
+//  The idle thread uses the stack the cpu is currently running on
+void ThreadInitCpu(Cpu * cpu);
+
+// Sets the location of a thread's UTCB in its address space
+//  addr must be aligned to UTCB_SIZE. UTCB pages are allocated and mapped by the kernel
+//  when first used, and are never mapped over user memory
+//  Returns false if addr is invalid, used by another thread or the kernel is out of memory
+//  Must be called by ThreadControl (with the thread table locked)
+bool ThreadSetUtcb(Thread * thread, uint64_t addr);
+
+// Switches to another thread on this cpu
+//  Returns when something switches back to the current thread
+void ThreadSwitch(Thread * to);
+
+// Blocks the current thread in the given state and runs something else
+void ThreadBlock(uint32_t state);
+
+// Makes a blocked thread runnable (cancelling its IPC timeout)
+void ThreadWake(Thread * thread);
+
+// Frees the memory of a deleted thread
+//  Called by IpcDelete once no other cpu can be using the thread
+void ThreadFree(Thread * thread);
+
+// ThreadControl system call
+//  rdi = thread to change
+//  rsi = thread whose address space the thread runs in (nil = delete the thread,
+//        the thread itself = create a new address space)
+//  rdx = scheduler (nil = don't change)
+//  r10 = pager (nil = don't change)
+//  r8  = UTCB location (-1 = don't change)
+//  New threads start when they have a pager and a UTCB, by waiting for a message
+//  from the pager containing the instruction pointer (MR1) and stack pointer (MR2)
+//  Returns 1 in rax on success, or 0 with the error in the caller's UTCB
+SyscallResult ThreadControlSyscall(uint64_t destId, uint64_t spaceId, uint64_t schedulerId,
+                                    uint64_t pagerId, uint64_t utcbAddr, uint64_t a6);
+
+// Adds a request to a cpu's mailbox
+//  This is lock free and can be called from any cpu
+//  Returns true if the mailbox was empty beforehand
+bool ThreadMailPost(Cpu * cpu, ThreadMail * mail);
+
+// Removes all the requests from the current cpu's mailbox
+//  Returns the requests in the order they were posted (linked with next)
+ThreadMail * ThreadMailTake(void);
+
+#endif
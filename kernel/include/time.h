@@ -23,6 +23,9 @@
 
 #include "global.h"
 #include "infopage.h"
+#include "list.h"
+
+struct Cpu;
 
 // Time period / time point type
 typedef uint16_t TimePeriod;
@@ -33,6 +36,85 @@ typedef uint16_t TimePeriod;
 // Infinite time period
 #define TIME_PEROID_INFINITE    ((TimePeriod) 0)
 
+// A time which never arrives
+#define TIME_NEVER              ((uint64_t) -1)
+
+// Timer wheel layout
+//  Level 0 has a slot for each of the next 64 ticks, and each slot of the level above
+//  covers a whole turn of the level below it (4 levels reach about 4.7 hours)
+#define TIME_WHEEL_TICK_LOG2    10      // Length of a tick (1024 us)
+#define TIME_WHEEL_TICK         (1UL << TIME_WHEEL_TICK_LOG2)
+#define TIME_WHEEL_SLOTS_LOG2   6
+#define TIME_WHEEL_SLOTS        (1 << TIME_WHEEL_SLOTS_LOG2)
+#define TIME_WHEEL_LEVELS       4
+
+struct TimeEvent;
+
+// Function called when an event is due
+//  This runs in the timer interrupt, so it must not switch threads (see SchedTimer)
+typedef void (* TimeEventHandler)(struct TimeEvent * event);
+
+// Something done at a certain time by the cpu which added it
+typedef struct TimeEvent
+{
+    ListNode node;                  // Node in a wheel slot (NULL if not pending)
+    uint64_t time;                  // Time the event is due
+    TimeEventHandler handler;       // Called when the event is due
+
+} TimeEvent;
+
+// Per-cpu timer wheel (stored in the Cpu structure)
+//  Events go in the slot of the lowest level which reaches them, so adding and
+//  cancelling events are list operations. When the wheel reaches the start of a
+//  higher level slot, its events are cascaded down a level
+//
+//  The timer is only set to the next tick with anything to do. Cancelling an event
+//  doesn't touch the timer, so an interrupt may find nothing due
+typedef struct TimeWheel
+{
+    uint64_t now;                               // Next tick to process
+    uint64_t occupied[TIME_WHEEL_LEVELS];       // Bit set for each non-empty slot
+    uint64_t deadline;                          // Time the timer is set to (TIME_NEVER = stopped)
+    List * slots;                               // Slots of each level (one page)
+
+} TimeWheel;
+
+// Starts the system clock (microseconds since this is called)
+//  The time stamp counter must have been calibrated first
+void TimeInit(void);
+
+// Returns the value of the system clock
+uint64_t TimeNow(void);
+
+// Allocates a cpu's timer wheel (the timer must be stopped)
+void TimeInitCpu(struct Cpu * cpu);
+
+// Handles the current cpu's timer interrupt
+//  Runs the events which are due, then lets the scheduler switch threads
+void TimeInterrupt(void);
+
+// Initializes an event (which is not pending)
+static inline void TimeEventInit(TimeEvent * event, TimeEventHandler handler)
+{
+    event->node.prev = NULL;
+    event->node.next = NULL;
+    event->handler = handler;
+}
+
+// Returns true if an event has been added and has not run or been cancelled
+static inline bool TimeEventPending(TimeEvent * event)
+{
+    return event->node.next != NULL;
+}
+
+// Adds an event to the current cpu's wheel (moving it if it's already pending)
+//  Events run at the first tick at or after the given time (times in the past run
+//  at the next tick). Only the current cpu may cancel it
+void TimeEventAdd(TimeEvent * event, uint64_t time);
+
+// Cancels an event on the current cpu (if pending)
+void TimeEventCancel(TimeEvent * event);
+
 // Creates a new time period of the given length (in microseconds)
 //  May return infinity if too large
 TimePeriod TimeMakePeriod(uint64_t microSeconds);
@@ -41,7 +123,7 @@ TimePeriod TimeMakePeriod(uint64_t microSeconds);
 //  This method may wraparound the clock
 uint64_t TimeExpandPeriodBase(TimePeriod period, uint64_t base);
 
-// Returns the millisecond value of the system clock added to the given time period
+// Returns the value of the system clock added to the given time period
 //  This method may wraparound the clock
 uint64_t TimeExpandPeriod(TimePeriod period);
 
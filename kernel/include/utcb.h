@@ -0,0 +1,82 @@
+#ifndef KERNEL_UTCB_H
+#define KERNEL_UTCB_H
+
+/*
+ * kernel/include/utcb.h
+ * User thread control blocks (virtual registers)
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+
+// Size and alignment of a UTCB (log 2)
+#define UTCB_SIZE_LOG2          10
+#define UTCB_SIZE               (1 << UTCB_SIZE_LOG2)
+
+// Smallest UTCB area (log 2)
+#define UTCB_AREA_LOG2          12
+
+// Number of message registers
+#define UTCB_MR_COUNT           64
+
+// Number of buffer registers (BR0 = acceptor, the rest describe string buffers)
+#define UTCB_BR_COUNT           33
+
+// Number of message registers copied by the IPC fast path (one cache line)
+#define UTCB_FAST_MR_COUNT      8
+
+// A user thread control block
+//  This is mapped into the thread's address space at its local id and the user's gs
+//  segment points to it. The kernel accesses it through the direct map
+//
+//  The IPC fast path only touches the first two cache lines of each thread
+//   Line 0 = thread control registers (including the error code)
+//   Line 1 = MR0-7
+typedef struct Utcb
+{
+    // Thread control registers
+    uint64_t myLocalId;             // Address of this UTCB (so user mode can read it from gs:0)
+    uint64_t myGlobalId;
+    uint64_t processorNo;
+    uint64_t userDefinedHandle;
+    uint64_t pager;
+    uint64_t exceptionHandler;
+    uint8_t  preemptFlags;
+    uint8_t  copFlags;
+    uint8_t  reserved[6];
+    uint64_t errorCode;             // Error from the last IPC (IPC_ERROR_)
+
+    uint64_t mr[UTCB_MR_COUNT];     // Message registers
+    uint64_t br[UTCB_BR_COUNT];     // Buffer registers
+
+    // Rarely used thread control registers
+    uint64_t xferTimeouts;
+    uint64_t intendedReceiver;
+    uint64_t virtualSender;
+
+    uint64_t unused[20];
+
+} ALIGN(64) Utcb;
+
+// Layout checks
+STATIC_ASSERT(sizeof(Utcb) == UTCB_SIZE);
+STATIC_ASSERT(offsetof(Utcb, myLocalId) == 0);
+STATIC_ASSERT(offsetof(Utcb, errorCode) + sizeof(uint64_t) <= 64);
+STATIC_ASSERT(offsetof(Utcb, mr) == 64);
+STATIC_ASSERT(offsetof(Utcb, mr[UTCB_FAST_MR_COUNT]) == 128);
+
+#endif
@@ -24,14 +24,20 @@
 #include "cpupriv.h"
 #include "ioports.h"
 #include "intr.h"
+#include "ipc.h"
 #include "kmemory.h"
-
-// Initial value for the APIC timer
-static uint32_t apicTimerInitial;
+#include "memory.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
 
 // Counter containing the number of up cpus
 static volatile uint32_t initCpusUp;
 
+// Number of low APIC id bits which select the SMT thread and the core + SMT thread
+static uint32_t apicSmtBits;
+static uint32_t apicCoreBits;
+
 // Verifies the checksum of an ACPI table
 static bool AcpiVerifyChecksum(void * data, uint32_t length)
 {
@@ -70,10 +76,19 @@ static AcpiRsdp * AcpiFindRsdpRange(uint32_t start, uint32_t end)
     return NULL;
 }
 
-// Finds and verifies the MADT
+// Finds and verifies the RSDT
 //  Returns NULL if a valid one couldn't be found
-static AcpiMadt * AcpiFindMadt(void)
+static AcpiRsdt * AcpiFindRsdt(void)
 {
+    static AcpiRsdt * rsdt;
+    static bool searched;
+
+    // Only search once
+    if (searched)
+        return rsdt;
+
+    searched = true;
+
     // Try to find the RSDP in EBDA and BIOS ROM
     AcpiRsdp * rsdp = AcpiFindRsdpRange(0x9FC00, 0x0A0000);
 
@@ -83,24 +98,38 @@ static AcpiMadt * AcpiFindMadt(void)
     if (rsdp && rsdp->rsdtAddr)
     {
         // Validate the RSDT
-        AcpiRsdt * rsdt = KMemFromPhysical(rsdp->rsdtAddr);
+        AcpiRsdt * newRsdt = KMemFromPhysical(rsdp->rsdtAddr);
 
-        if (memcmp(rsdt->header.type, "RSDT", 4) == 0 &&
-            AcpiVerifyChecksum(rsdt, rsdt->header.length))
+        if (memcmp(newRsdt->header.type, "RSDT", 4) == 0 &&
+            AcpiVerifyChecksum(newRsdt, newRsdt->header.length))
         {
-            // Search the RSDT for the MADT
-            uint32_t entries = (rsdt->header.length - sizeof(AcpiTableHeader)) / 4;
+            rsdt = newRsdt;
+        }
+    }
 
-            for (uint32_t i = 0; i < entries; i++)
-            {
-                AcpiMadt * madt = KMemFromPhysical(rsdt->entry[i]);
+    return rsdt;
+}
 
-                if (memcmp(madt->header.type, "APIC", 4) == 0 &&
-                    AcpiVerifyChecksum(madt, madt->header.length))
-                {
-                    // Good MADT
-                    return madt;
-                }
+// Finds and verifies the ACPI table with the given signature
+//  Returns NULL if a valid one couldn't be found
+static void * AcpiFindTable(const char * signature)
+{
+    AcpiRsdt * rsdt = AcpiFindRsdt();
+
+    if (rsdt)
+    {
+        // Search the RSDT for the table
+        uint32_t entries = (rsdt->header.length - sizeof(AcpiTableHeader)) / 4;
+
+        for (uint32_t i = 0; i < entries; i++)
+        {
+            AcpiTableHeader * table = KMemFromPhysical(rsdt->entry[i]);
+
+            if (memcmp(table->type, signature, 4) == 0 &&
+                AcpiVerifyChecksum(table, table->length))
+            {
+                // Good table
+                return table;
             }
         }
     }
@@ -108,14 +137,82 @@ static AcpiMadt * AcpiFindMadt(void)
     return NULL;
 }
 
+// Finds and verifies the MADT
+//  Returns NULL if a valid one couldn't be found
+static AcpiMadt * AcpiFindMadt(void)
+{
+    return AcpiFindTable("APIC");
+}
+
+// Proximity domains of each NUMA node
+static uint32_t numaDomains[KMEM_MAX_NODES];
+static uint32_t numaDomainCount;
+
+// Converts an ACPI proximity domain into a NUMA node number
+//  If add is true, unknown domains are given a new node
+//  Returns -1 if the domain is unknown (or there are too many)
+static int AcpiDomainToNode(uint32_t domain, bool add)
+{
+    for (uint32_t i = 0; i < numaDomainCount; i++)
+    {
+        if (numaDomains[i] == domain)
+            return i;
+    }
+
+    if (!add || numaDomainCount >= KMEM_MAX_NODES)
+        return -1;
+
+    numaDomains[numaDomainCount] = domain;
+    return numaDomainCount++;
+}
+
+// Finds how APIC ids are split into packages, cores and SMT threads
+//  All the cpus are assumed to be the same as the boot cpu
+static void CpuFindTopology(void)
+{
+    uint32_t regs[4];
+
+    CpuId(0, 0, regs);
+
+    if (regs[0] >= 0xB)
+    {
+        // Extended topology leaf (level 0 = SMT, level 1 = core)
+        CpuId(0xB, 0, regs);
+        if (regs[1] != 0)
+        {
+            apicSmtBits = regs[0] & 0x1F;
+
+            CpuId(0xB, 1, regs);
+            apicCoreBits = (regs[1] != 0) ? (regs[0] & 0x1F) : apicSmtBits;
+            return;
+        }
+    }
+
+    // Otherwise only the number of logical cpus in each package is known
+    CpuId(1, 0, regs);
+    if (regs[3] & (1 << 28))
+    {
+        uint32_t logical = (regs[1] >> 16) & 0xFF;
+
+        while ((1U << apicCoreBits) < logical)
+            apicCoreBits++;
+    }
+}
+
 // Adds a new CPU with the given APIC id
 static void AddNewCpu(uint32_t apicId)
 {
-    Cpu * newCpu = KMemAllocate();
+    // Other cpus read the scheduler state of cpus which haven't started yet
+    Cpu * newCpu = KMemZAllocate();
 
     // Initialize CPU structure
+    newCpu->self = newCpu;
+    newCpu->kernelStack = 0;
     newCpu->id = CpuCount;
     newCpu->apicId = apicId;
+    newCpu->node = CpuApicToNode[apicId] < KMemNodeCount ? CpuApicToNode[apicId] : 0;
+    newCpu->core = apicId >> apicSmtBits;
+    newCpu->package = apicId >> apicCoreBits;
 
     newCpu->gdt[0] = 0;
     newCpu->gdt[1] = GDT_KERNEL_CODE;
@@ -127,6 +224,8 @@ static void AddNewCpu(uint32_t apicId)
     newCpu->gdt[5] = GDT_TSS | ((tssAddr & 0x00FFFFFF) << 16) | ((tssAddr & 0xFF000000) << 32);
     newCpu->gdt[6] = tssAddr >> 32;
 
+    KMemCpuCacheInit(&newCpu->kmemCache);
+
     // Add to tables
     CpuApicToCpuId[apicId] = CpuCount;
     CpuList[CpuCount++] = newCpu;
@@ -138,6 +237,9 @@ static void ParseAcpiTables(void)
 {
     bool ioApicSetup = false;
 
+    // Find the cpu topology first so new cpus can be put in their cores and packages
+    CpuFindTopology();
+
     // Get the MADT from the ACPI tables
     AcpiMadt * madt = AcpiFindMadt();
 
@@ -201,8 +303,7 @@ static void ParseAcpiTables(void)
     }
 }
 
-// Calculates the settings for the APIC timer which
-//  fire interrupts at the correct frequency
+// Measures the speed of the APIC timer and the time stamp counter
 static void ApicCalibrateTimer(void)
 {
     // Enable APIC timer
@@ -221,20 +322,28 @@ static void ApicCalibrateTimer(void)
     IoOutB(PIT_PORT_GATE,    oldGatePort | 1);
 
     ApicWrite32(APIC_REG_TIME_INIT, 0xFFFFFFFF);
+    uint64_t tscStart = CpuReadTsc();
 
     // Wait until PIT is finished
     while ((IoInB(PIT_PORT_GATE) & 0x20) == 0)
         AtomicPause();
 
     // Disable APIC timer and get the counter value
+    uint64_t tscEnd = CpuReadTsc();
     ApicWrite32(APIC_REG_LVT_TIMER, APIC_LVT_DISABLE);
     uint32_t apicCounterVal = ApicRead32(APIC_REG_TIME_CURR);
 
-    // Calculate bus frequency in Hz (elapsed ticks * divide value * 1/10ms)
+    // Calculate bus and TSC frequencies in Hz (elapsed ticks * divide value * 1/10ms)
     CpuExternalBusFreq = (0xFFFFFFFF - apicCounterVal) * 2 * 100;
+    CpuTscFreq = (tscEnd - tscStart) * 100;
+
+    // APIC timer counts per TSC tick (the timer is divided by 2)
+    CpuApicTimerMult = ((CpuExternalBusFreq / 2) << 32) / CpuTscFreq;
 
-    // Calculate APIC initial value
-    apicTimerInitial = CpuExternalBusFreq / CONFIG_HZ;
+    // Use TSC-deadline mode if the cpu has it
+    uint32_t regs[4];
+    CpuId(1, 0, regs);
+    CpuTscDeadline = (regs[2] & (1 << 24)) != 0;
 }
 
 // Initializes the base registers of the local APIC (everything except timer)
@@ -260,10 +369,11 @@ static void ApicBaseInit(void)
 
 // Initializes the APIC timer on this CPU
 //  ApicCalibrateTimer must have been called before this
+//  The timer is left stopped until something sets it (see TimeEventAdd)
 static void ApicTimerInit(void)
 {
-    ApicWrite32(APIC_REG_LVT_TIMER, INTR_APIC_TIMER | 0x20000);
-    ApicWrite32(APIC_REG_TIME_INIT, apicTimerInitial);
+    ApicWrite32(APIC_REG_LVT_TIMER, INTR_APIC_TIMER |
+                (CpuTscDeadline ? APIC_TIMER_TSC_DEADLINE : APIC_TIMER_ONE_SHOT));
 }
 
 // Performs the parts of CPU initialization which can be done later
@@ -282,10 +392,18 @@ static void CpuLateInit(Cpu * cpu)
     gdtPtr.ptr  = cpu->gdt;
 
     // Run assembly part of initialization
-    CpuLateInitAsm(&gdtPtr.size);
+    CpuLateInitAsm(&gdtPtr.size, cpu);
 
-    // Start APIC timer
+    // Setup PCIDs
+    MemInitCpu(&cpu->mem);
+
+    // Create idle thread and run queues
+    ThreadInitCpu(cpu);
+    SchedInitCpu(cpu);
+
+    // Setup APIC timer (stopped)
     ApicTimerInit();
+    TimeInitCpu(cpu);
 
     // Mark CPU as up
     AtomicAdd(&initCpusUp, 1);
@@ -300,11 +418,94 @@ void NO_RETURN CpuApEntry(Cpu * cpu)
     // Do late initialization
     CpuLateInit(cpu);
 
-    // Just hang for the moment
-#warning Todo go into some sort of idle loop here
-    BREAKPOINT;
+    // Idle loop
+    //  Run threads and do background work until there's none left, then halt
+    //  Interrupts are only enabled while halted (so IPIs like TLB shootdowns are handled)
+    //  Every time the cpu wakes up with nothing to run it tries to steal a thread
     for(;;)
-        asm volatile ("hlt");
+    {
+        IpcMailboxProcess();
+
+        Thread * next = SchedNext();
+
+        if (next != cpu->idleThread)
+        {
+            SchedSwitch(next);
+        }
+        else
+        {
+            SchedBalance();
+
+            if (!KMemZeroIdle())
+                asm volatile ("sti; hlt; cli");
+        }
+    }
+}
+
+void CpuInitNuma(void)
+{
+    // Parse the SRAT for cpu and memory nodes
+    AcpiSrat * srat = AcpiFindTable("SRAT");
+
+    if (srat == NULL)
+        return;
+
+    uint32_t sratStructLen = srat->header.length - sizeof(AcpiSrat);
+
+    for (uint32_t i = 0; i < sratStructLen && srat->data[i + 1] != 0; i += srat->data[i + 1])
+    {
+        uint8_t * entry = &srat->data[i];
+
+        if (entry[0] == ACPI_SRAT_APIC)
+        {
+            // Local APIC affinity (domain is split into low byte + high 3 bytes)
+            uint32_t domain = entry[2] | (entry[9] << 8) | (entry[10] << 16) | (entry[11] << 24);
+            int node = AcpiDomainToNode(domain, true);
+
+            if ((*(uint32_t *) &entry[4] & ACPI_SRAT_EN) && node >= 0)
+                CpuApicToNode[entry[3]] = node;
+        }
+        else if (entry[0] == ACPI_SRAT_X2APIC)
+        {
+            // x2APIC affinity (only xAPIC ids are supported)
+            uint32_t apicId = *(uint32_t *) &entry[8];
+            int node = AcpiDomainToNode(*(uint32_t *) &entry[4], true);
+
+            if ((*(uint32_t *) &entry[12] & ACPI_SRAT_EN) && node >= 0 && apicId < APIC_MAX_CPU)
+                CpuApicToNode[apicId] = node;
+        }
+        else if (entry[0] == ACPI_SRAT_MEMORY)
+        {
+            // Memory affinity
+            uint64_t base = *(uint64_t *) &entry[8];
+            uint64_t length = *(uint64_t *) &entry[16];
+            int node = AcpiDomainToNode(*(uint32_t *) &entry[2], true);
+
+            if ((*(uint32_t *) &entry[28] & ACPI_SRAT_EN) && node >= 0)
+                KMemAddNodeRange(base, base + length, node);
+        }
+    }
+
+    // Parse the SLIT for the distances between nodes
+    AcpiSlit * slit = AcpiFindTable("SLIT");
+
+    if (slit == NULL)
+        return;
+
+    uint64_t localities = slit->localities;
+
+    for (uint64_t from = 0; from < localities; from++)
+    {
+        int fromNode = AcpiDomainToNode(from, false);
+
+        for (uint64_t to = 0; to < localities && fromNode >= 0; to++)
+        {
+            int toNode = AcpiDomainToNode(to, false);
+
+            if (toNode >= 0)
+                KMemSetNodeDistance(fromNode, toNode, slit->entry[from * localities + to]);
+        }
+    }
 }
 
 void CpuInitAll(void)
@@ -323,6 +524,7 @@ void CpuInitAll(void)
 
     // While the BIOS is initializing the other processors, we can calibrate the APIC timer
     ApicCalibrateTimer();
+    TimeInit();
 
     // Copy lower memory code
     if (CpuCount > 1)
@@ -338,4 +540,7 @@ void CpuInitAll(void)
     // Wait for all other processors to complete
     while (initCpusUp < CpuCount)
         AtomicPause();
+
+    // All cpus are in CpuList so memory can now be allocated through the cpu caches
+    KMemCpuCacheEnable();
 }
@@ -138,7 +138,7 @@ Boot64Start:
 
 CpuLateInitAsm:
     # Finishes the initialization of the current CPU
-    #  void CpuLateInitAsm(void * gdtPtr);
+    #  void CpuLateInitAsm(void * gdtPtr, Cpu * cpu);
 
     # Reset FPU
     fninit
@@ -162,6 +162,19 @@ CpuLateInitAsm:
     mov gs, ax
     mov ss, ax
 
+    # Point the kernel gs at the cpu structure (user gs starts at 0)
+    #  This must be done after loading gs since that may clear the base
+    mov rax, rsi
+    mov rdx, rsi
+    shr rdx, 32
+    mov ecx, 0xC0000101     # MSR_GS_BASE
+    wrmsr
+
+    xor eax, eax
+    xor edx, edx
+    mov ecx, 0xC0000102     # MSR_KERNEL_GS_BASE
+    wrmsr
+
     # Setup syscall MSRs
     xor eax, eax
     mov edx, 0x00130008     # SYSCALL and SYSRET segments
@@ -176,7 +189,7 @@ CpuLateInitAsm:
 
     xor rdx, rdx
     mov eax, 0x00000700     # Clear DF, TF, IF on SYSCALL
-    mov ecx, 0xC0000082     # MSR_FMASK
+    mov ecx, 0xC0000084     # MSR_FMASK
     wrmsr
 
     ret
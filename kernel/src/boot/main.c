@@ -20,19 +20,30 @@
 
 #include "global.h"
 #include "cpu.h"
+#include "infopage.h"
 #include "intr.h"
 #include "kmemory.h"
+#include "mapdb.h"
 #include "memory.h"
 #include "multiboot.h"
+#include "thread.h"
 
 void NO_RETURN BootMain(MultibootInfo * bootInfo);
 
 void NO_RETURN BootMain(MultibootInfo * bootInfo)
 {
-#warning Todo - use the memory map for this
-    // Setup the kernel memory manager (currently 2MB starting at 2MB address)
-    (void) bootInfo;
-    KMemInit(0x00200000, 0x00200000);
+    // Find NUMA nodes (before the memory manager so memory can be split between them)
+    CpuInitNuma();
+
+    // Setup the kernel memory manager from the memory map
+    KMemInit(bootInfo);
+
+    // Map the rest of physical memory and allow the allocator to use it
+    MemInitDirectMap(KMemPhysicalEnd);
+    KMemInitHigh();
+
+    // Setup the kernel info page (requires the memory map)
+    InfoPageInit();
 
     // Setup IDT
     IntrInitIdt();
@@ -43,5 +54,11 @@ void NO_RETURN BootMain(MultibootInfo * bootInfo)
     // Enable global flag in all pages
     MemEnableGlobalPages();
 
+    // Setup mapping database
+    MapInit();
+
+    // Setup the thread table
+    ThreadInit();
+
     Panic("Nothing here yet");
 }
@@ -26,6 +26,7 @@
 
 // Global CPU variables
 uint64_t CpuExternalBusFreq;
+uint64_t CpuTscFreq;
 uint32_t CpuCount;
 Cpu * CpuList[APIC_MAX_CPU];
 
@@ -35,6 +36,13 @@ volatile uint8_t * CpuLocalApic;
 // Converts the high 8 bits of the apic id to a cpu id
 uint32_t CpuApicToCpuId[APIC_MAX_CPU];
 
+// Converts the high 8 bits of the apic id to a NUMA node
+uint32_t CpuApicToNode[APIC_MAX_CPU];
+
+// APIC timer settings
+bool CpuTscDeadline;
+uint64_t CpuApicTimerMult;
+
 void CpuSendIpi(Cpu * dest, uint32_t lowFields)
 {
     // Wait for previous IPI to complete
@@ -46,10 +54,14 @@ void CpuSendIpi(Cpu * dest, uint32_t lowFields)
     ApicWrite32(APIC_REG_INTR_CMD       , lowFields);
 }
 
-Cpu * CpuCurrent(void)
+void CpuSendIpiOthers(uint32_t lowFields)
 {
-    // Get APIC id and lookup in cpu list
-    return CpuList[CpuApicToCpuId[ApicRead32(APIC_REG_ID) >> 24]];
+    // Wait for previous IPI to complete
+    while (ApicRead32(APIC_REG_INTR_CMD) & APIC_IPI_BUSY)
+        AtomicPause();
+
+    // Send to everyone using the destination shorthand
+    ApicWrite32(APIC_REG_INTR_CMD, lowFields | APIC_IPI_OTHERS);
 }
 
 int CpuGetHardwareIntr(void)
@@ -77,3 +89,33 @@ void CpuSendEoi(void)
 {
     ApicWrite32(APIC_REG_EOI, 1);
 }
+
+void CpuSetTimer(uint64_t tsc)
+{
+    if (CpuTscDeadline)
+    {
+        CpuWriteMsr(CPU_MSR_TSC_DEADLINE, tsc);
+        return;
+    }
+
+    // One shot mode (writing 0 stops the timer)
+    uint64_t count = 0;
+
+    if (tsc != 0)
+    {
+        uint64_t now = CpuReadTsc();
+        uint64_t delta = (tsc > now) ? tsc - now : 0;
+
+        // Long times are cut short (the timer interrupt sets the timer again)
+        if (delta > 0xFFFFFFFF)
+            delta = 0xFFFFFFFF;
+
+        count = (delta * CpuApicTimerMult) >> 32;
+        if (count == 0)
+            count = 1;
+        else if (count > 0xFFFFFFFF)
+            count = 0xFFFFFFFF;
+    }
+
+    ApicWrite32(APIC_REG_TIME_INIT, (uint32_t) count);
+}
@@ -20,7 +20,10 @@
 
 #include "global.h"
 #include "infopage.h"
+#include "kmemory.h"
+#include "thread.h"
 #include "time.h"
+#include "utcb.h"
 
 // The global info page
 InfoPageType InfoPage ALIGN(4096);
@@ -28,6 +31,17 @@ InfoPageType InfoPage ALIGN(4096);
 // System calls to be copied over
 extern char InfoUserSyscalls, InfoUserSyscallsEnd;
 
+// Adds a memory descriptor to the info page
+static void InfoPageAddMemDesc(uint64_t base, uint64_t end, uint8_t type, uint8_t subType)
+{
+    if (InfoPage.memNumber >= INFO_MAX_MEM_DESC)
+        Panic("Too many memory descriptors for the info page");
+
+    InfoMemDesc * desc = &InfoPage.memDesc[InfoPage.memNumber++];
+    desc->low  = (base & ~0x3FFUL) | ((subType & 0xF) << 4) | (type & 0xF);
+    desc->high = (end - 1) & ~0x3FFUL;
+}
+
 void InfoPageInit(void)
 {
     // Fill info page constants
@@ -44,19 +58,49 @@ void InfoPageInit(void)
 
     InfoPage.kipSize        = 12;           // = 2^12 = 4096
 
-    InfoPage.clockPrecision = TimeMakePeriod(1000000 / CONFIG_HZ);
+    InfoPage.clockPrecision = TimeMakePeriod(1);
     InfoPage.pageInfo       = 0x00201003;   // 2MB and 4KB pages, Write and Execute changable
 
-#warning Todo - fill in utcbInfo and threadInfo
-    InfoPage.utcbInfo       = 0;
-    InfoPage.threadInfo     = 0;
+    // UTCB area size (log 2) << 10 | UTCB alignment (log 2) << 4 | UTCB size multiplier
+    InfoPage.utcbInfo       = (UTCB_AREA_LOG2 << 10) | (UTCB_SIZE_LOG2 << 4) | 1;
+
+    // Thread number bits << 24 | first system thread << 12 | first user thread
+    InfoPage.threadInfo     = (THREAD_NUMBER_BITS << 24) | (THREAD_SYSTEM_BASE << 12) | THREAD_USER_BASE;
 
     // Copy system calls
-    memcpy(&InfoPage.pscSpaceControl, &InfoUserSyscalls,
-            (uint64_t) (&InfoUserSyscallsEnd - &InfoUserSyscalls));
+    uint64_t syscallsLength = (uint64_t) (&InfoUserSyscallsEnd - &InfoUserSyscalls);
+    Assert(syscallsLength <= offsetof(InfoPageType, memDesc) -
+                             offsetof(InfoPageType, pscSpaceControl));
+
+    memcpy(&InfoPage.pscSpaceControl, &InfoUserSyscalls, syscallsLength);
 
-#warning Todo - memory regions and processors
     // Memory regions
+    //  Later descriptors override earlier ones so the whole of memory is undefined first
+    InfoPage.memPtr = offsetof(InfoPageType, memDesc);
+    InfoPage.memNumber = 0;
+
+    InfoPageAddMemDesc(0, 0, INFO_MEM_UNDEFINED, 0);
+
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
+    {
+        KMemRegion * region = &KMemRegions[i];
+
+        switch (region->type)
+        {
+            case KMEM_REGION_USABLE:
+                InfoPageAddMemDesc(region->base, region->end, INFO_MEM_CONVENTIONAL, 0);
+                break;
+
+            case KMEM_REGION_RESERVED:
+                InfoPageAddMemDesc(region->base, region->end, INFO_MEM_ARCH, region->firmwareType);
+                break;
+
+            case KMEM_REGION_KERNEL:
+                InfoPageAddMemDesc(region->base, region->end, INFO_MEM_RESERVED, 0);
+                break;
+        }
+    }
 
+#warning Todo - processors
     // Processors
 }
@@ -22,7 +22,13 @@
 #include "cpu.h"
 #include "ioports.h"
 #include "intr.h"
+#include "ipc.h"
 #include "kmemory.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
 
 // IO APIC Information
 typedef struct IntrIoApic
@@ -69,6 +75,8 @@ void IntrIsr32();
 
 // APIC Interrupts
 void IntrIsr240();
+void IntrIsr241();
+void IntrIsr242();
 
 // Fills in an IDT entry with the given ISR
 static void FillIdtEntry(int index, void (* isr))
@@ -116,6 +124,8 @@ void IntrInitIdt(void)
 
     // Fill APIC Interrupts
     FillIdtEntry(240, IntrIsr240);
+    FillIdtEntry(241, IntrIsr241);
+    FillIdtEntry(242, IntrIsr242);
     FillIdtEntry(255, IntrIsrIgnore);
 
     // Allow INT 3 (breakpoints) to be called from user mode
@@ -298,17 +308,27 @@ void IntrHandler(IntrContext context)
             break;
 
         // Special Exceptions
-        case INTR_CPU_PF:
-#warning TODO Handle Page Fault
-            break;
-
         case INTR_CPU_NM:
 #warning TODO Handle No Math Device
             break;
 
         // APIC Interrupts
         case INTR_APIC_TIMER:
-#warning TODO Handle APIC Timer interrupt
+            // Acknowledge before switching threads so other interrupts aren't blocked
+            IpcMailboxProcess();
+            CpuSendEoi();
+            TimeInterrupt();
+            break;
+
+        case INTR_APIC_SHOOTDOWN:
+            MemShootdownHandler();
+            CpuSendEoi();
+            break;
+
+        case INTR_APIC_RESCHEDULE:
+            IpcMailboxProcess();
+            CpuSendEoi();
+            SchedPreempt();
             break;
 
         // Hardware Interrupts
@@ -328,3 +348,25 @@ void IntrHandler(IntrContext context)
         }
     }
 }
+
+void IntrPageFault(IntrContext context)
+{
+    uint64_t addr;
+
+    // Read the fault address before anything else can fault
+    __asm volatile("mov %%cr2, %0" : "=r"(addr));
+
+    if (context.cs == INTR_SELECTOR)
+        Panic("Page fault within the kernel");
+
+    // Work out what type of access caused the fault
+    uint32_t access = MAP_RIGHT_R;
+
+    if (context.intrError & INTR_PF_WRITE)
+        access = MAP_RIGHT_W;
+    else if (context.intrError & INTR_PF_FETCH)
+        access = MAP_RIGHT_X;
+
+    // Ask the pager to resolve the fault
+    IpcPageFault(ThreadCurrent(), addr, context.rip, access);
+}
@@ -25,6 +25,18 @@
 .global IntrIsrIgnore
 # All ISRs are also global
 
+# Offsets of fields in the Cpu structure
+.set CPU_KERNEL_STACK,  8
+.set CPU_USER_STACK,    16
+
+# Number of system calls (SYSCALL_COUNT)
+.set SYSCALL_COUNT,     10
+
+# End of user memory (MEM_USER_END) and user mode segments (see MSR_STAR)
+.set MEM_USER_END,          0x800000000000
+.set USER_CODE_SELECTOR,    0x23
+.set USER_DATA_SELECTOR,    0x1B
+
 .text
 IntrIsrIgnore:
     # Ignored interrupts
@@ -62,7 +74,7 @@ IntrIsr\num:
     IsrErrorCode    11      # NP  - Segment Not Present
     IsrErrorCode    12      # SS  - Stack Fault
     IsrErrorCode    13      # GP  - General Protection Fault
-    IsrErrorCode    14      # PF  - Page Fault
+    #IsrErrorCode   14      # PF  - Page Fault (see below)
     #IsrNormal      15      # --  - Reserved
     IsrNormal       16      # MP  - FPU Exception
     IsrErrorCode    17      # AC  - Alignment Check
@@ -75,11 +87,16 @@ IntrIsr\num:
 
     # APIC Interrupts
     IsrNormal       240     # Timer Interrupt
+    IsrNormal       241     # TLB Shootdown
+    IsrNormal       242     # Reschedule
     #IsrNormal      255     # Spurious Interrupt (always ignored)
 
-IntrEntry:
-    # Interrupt entry point
-    #  Error code and interrupt number already pushed on the stack
+.macro IntrSaveRegs
+    # Switch to the kernel gs if the interrupt came from user mode
+    test byte ptr [rsp + 24], 3
+    jz 1f
+    swapgs
+1:
 
     # Push anything which isn't saved across C function calls
     push r11
@@ -91,10 +108,9 @@ IntrEntry:
     push rdx
     push rcx
     push rax
+.endm
 
-    # Call interrupt handling function
-    call IntrHandler
-
+.macro IntrRestoreRegs
     # Pop registers
     pop rax
     pop rcx
@@ -106,9 +122,38 @@ IntrEntry:
     pop r10
     pop r11
 
-    # Pop interrupt and error numbers, and complete interrupt
+    # Pop interrupt and error numbers
     add rsp, 16
+
+    # Restore the user gs if returning to user mode, and complete interrupt
+    test byte ptr [rsp + 8], 3
+    jz 1f
+    swapgs
+1:
     iretq
+.endm
+
+IntrEntry:
+    # Interrupt entry point
+    #  Error code and interrupt number already pushed on the stack
+    IntrSaveRegs
+
+    # Call interrupt handling function
+    call IntrHandler
+
+    IntrRestoreRegs
+
+.global IntrIsr14
+IntrIsr14:
+    # Page fault entry point
+    #  Page faults skip IntrHandler so the fault message is sent as quickly as possible
+    #  The faulting thread returns here when its pager replies
+    push 14
+    IntrSaveRegs
+
+    call IntrPageFault
+
+    IntrRestoreRegs
 
 IntrEntryPanicNoError:
 IntrEntryPanic:
@@ -119,11 +164,74 @@ IntrEntryPanic:
     xchg bx, bx
     hlt
 
+    .align 16
 EntrySyscall:
     # Syscall entry point
+    #  rax = system call number
     #  rcx = user mode rip
     #  r11 = user mode rflags
     #  rsp = USER MODE STACK (still)
+    #  Interrupts are disabled by MSR_FMASK
 
-    xchg bx, bx
-    sysret
+    # Switch to the current thread's kernel stack
+    swapgs
+    mov gs:[CPU_USER_STACK], rsp
+    mov rsp, gs:[CPU_KERNEL_STACK]
+
+    # Save user state (SyscallFrame)
+    #  The user stack is saved here since the thread may block in the system call
+    push qword ptr gs:[CPU_USER_STACK]
+    push r11
+    push rcx
+
+    # Dispatch system call (4th argument is in r10 since syscall uses rcx)
+    cmp rax, SYSCALL_COUNT
+    jae EntrySyscall.invalid
+
+    mov rcx, r10
+    call [SyscallTable + rax*8]
+
+EntrySyscall.return:
+    # Clear scratch registers so kernel data isn't leaked (rax and rdx are results)
+    xor esi, esi
+    xor edi, edi
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+
+    # Restore user state and return
+    #  On Intel cpus, sysretq to a non-canonical rip raises #GP in ring 0 with the user
+    #  stack and gs already loaded. A syscall in the last page of user memory returns
+    #  to MEM_USER_END, so anything that high goes through iretq instead (the page is
+    #  never mapped, see MEM_USER_MAP_END, so this shouldn't happen)
+    mov rcx, MEM_USER_END
+    cmp [rsp], rcx
+    jae EntrySyscall.iret
+
+    pop rcx
+    pop r11
+    pop rsp
+    swapgs
+    sysretq
+
+EntrySyscall.iret:
+    # Return with an interrupt frame built from the SyscallFrame
+    pop rcx
+    pop r11
+    pop rsi
+
+    push USER_DATA_SELECTOR
+    push rsi
+    push r11
+    push USER_CODE_SELECTOR
+    push rcx
+
+    xor esi, esi
+    swapgs
+    iretq
+
+EntrySyscall.invalid:
+    # Invalid system call number
+    xor eax, eax
+    xor edx, edx
+    jmp EntrySyscall.return
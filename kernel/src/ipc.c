@@ -0,0 +1,813 @@
+/*
+ * kernel/src/ipc.c
+ * Inter-process communication
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "cpu.h"
+#include "intr.h"
+#include "ipc.h"
+#include "kmemory.h"
+#include "list.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
+
+// Tag bits which must be clear to use the fast path
+//  No flags, no typed items and fewer than 8 untyped words (one cache line with MR0)
+#define IPC_FAST_TAG_MASK   0xFFF8
+
+// Tag bits which must be clear to use local IPC (no flags or typed items)
+#define IPC_LOCAL_TAG_MASK  0xFFC0
+
+// Requests sent between cpus in thread mailboxes
+//  IPC between threads on different cpus is done by the receiver's cpu so the IPC
+//  state of a thread is only ever changed by the cpu it runs on (and needs no locks)
+#define IPC_MAIL_SEND       0   // Send the message of the posting thread to mail.target
+#define IPC_MAIL_COMPLETE   1   // Send phase of mail.target has finished (with mail.error)
+#define IPC_MAIL_DELETE     2   // The posting thread has been deleted (see IpcDelete)
+
+// Returns true if to is waiting for a message from thread
+static inline bool IpcIsWaiting(Thread * to, Thread * from)
+{
+    return to->state == THREAD_STATE_RECEIVING && (to->partner == NULL || to->partner == from);
+}
+
+// Returns the number of bytes from addr to the end of its page
+static inline uint64_t IpcPageLeft(uint64_t addr, uint64_t flags)
+{
+    uint64_t size = (flags & MEM_PAGE_LARGE) ? MEM_PAGE_2MB : MEM_PAGE_4KB;
+    return size - (addr & (size - 1));
+}
+
+// Copies size bytes from one address space to another
+//  Both sides are accessed through the direct map of physical memory, so the data is
+//  copied once with no intermediate buffer, whichever address space is loaded
+//  Returns the sender's error code if a page is missing (0 = success)
+//  Pages outside the direct map (like device memory) count as missing
+static uint64_t IpcCopyString(MemSpace * fromSpace, uint64_t src,
+                                MemSpace * toSpace, uint64_t dst, uint64_t size)
+{
+    const uint64_t dstRights = MEM_PAGE_USER | MEM_PAGE_WRITABLE;
+    uint64_t error = 0;
+
+    while (size > 0 && error == 0)
+    {
+        uint64_t srcPhys, dstPhys, srcFlags, dstFlags;
+
+        // The pages can't be unmapped (and their tables freed) while they're copied
+        MemSpaceLockPair(fromSpace, toSpace);
+
+        if (!MemSpaceLookup(fromSpace, src, &srcPhys, &srcFlags) || !(srcFlags & MEM_PAGE_USER))
+        {
+            error = IPC_ERROR_XFER_INVOKER;
+        }
+        else if (!MemSpaceLookup(toSpace, dst, &dstPhys, &dstFlags) ||
+                    (dstFlags & dstRights) != dstRights)
+        {
+            error = IPC_ERROR_XFER_PARTNER;
+        }
+        else
+        {
+            // Copy up to the end of whichever page ends first
+            uint64_t chunk = IpcPageLeft(src, srcFlags);
+            uint64_t dstLeft = IpcPageLeft(dst, dstFlags);
+
+            if (chunk > dstLeft)
+                chunk = dstLeft;
+            if (chunk > size)
+                chunk = size;
+
+            if (srcPhys + chunk > KMemPhysicalEnd)
+                error = IPC_ERROR_XFER_INVOKER;
+            else if (dstPhys + chunk > KMemPhysicalEnd)
+                error = IPC_ERROR_XFER_PARTNER;
+            else
+                memcpy(KMemFromPhysical(dstPhys), KMemFromPhysical(srcPhys), chunk);
+
+            src += chunk;
+            dst += chunk;
+            size -= chunk;
+        }
+
+        MemSpaceUnlockPair(fromSpace, toSpace);
+    }
+
+    return error;
+}
+
+// Copies the string item at from->utcb->mr[i] into the next string buffer of to
+//  buffer = index of the next string buffer in to->br (updated)
+//  Returns the sender's error code (0 = success)
+static uint64_t IpcTransferString(Thread * from, Thread * to, uint32_t i, uint32_t * buffer)
+{
+    uint64_t item = from->utcb->mr[i];
+
+    if (*buffer + 1 >= UTCB_BR_COUNT || IPC_STRING_SUBSTRINGS(item) != 0 ||
+        from->space == NULL || to->space == NULL)
+    {
+        return IPC_ERROR_OVERFLOW;
+    }
+
+    uint64_t bufferItem = to->utcb->br[*buffer];
+    uint64_t bufferAddr = to->utcb->br[*buffer + 1];
+
+    if (IPC_STRING_LENGTH(item) > IPC_STRING_LENGTH(bufferItem))
+        return IPC_ERROR_OVERFLOW;
+
+    // Each string uses up one buffer (the continue bit is clear in the last one)
+    if (bufferItem & IPC_ITEM_CONTINUE)
+        *buffer += 2;
+    else
+        *buffer = UTCB_BR_COUNT;
+
+    // The receiver's copy of the item points to where the string was put
+    to->utcb->mr[i + 1] = bufferAddr;
+
+    return IpcCopyString(from->space, from->utcb->mr[i + 1], to->space, bufferAddr,
+                            IPC_STRING_LENGTH(item));
+}
+
+// Sets the error code of the last IPC
+//  receive = true if the error occured in the receive phase
+static bool IpcError(Thread * thread, uint64_t error, bool receive)
+{
+    thread->utcb->errorCode = (error << 1) | receive;
+    thread->utcb->mr[0] = IPC_TAG_ERROR;
+    return false;
+}
+
+void IpcWaitFrom(Thread * thread, Thread * from)
+{
+    thread->partner = from;
+
+    if (from)
+    {
+        AtomicLock(&from->receiversLock);
+        ListAddLast(&from->receivers, &thread->recvNode);
+        AtomicUnlock(&from->receiversLock);
+    }
+}
+
+// Ends the wait started by IpcWaitFrom (the partner must not have changed since)
+static inline void IpcWaitEnd(Thread * thread)
+{
+    Thread * from = thread->partner;
+
+    if (thread->recvNode.next)
+    {
+        AtomicLock(&from->receiversLock);
+        ListDelete(&thread->recvNode);
+        AtomicUnlock(&from->receiversLock);
+    }
+}
+
+// Copies a message between two threads, installing any mappings and copying any strings
+//  Returns the sender's error code if the transfer failed (0 = success)
+//  The receiver's error code is set here
+static uint64_t IpcTransfer(Thread * from, Thread * to)
+{
+    uint64_t tag = from->utcb->mr[0];
+    uint32_t untyped = IPC_TAG_U(tag);
+    uint32_t words = untyped + IPC_TAG_T(tag);
+    uint32_t buffer = (to->utcb->br[0] & IPC_ACCEPT_STRINGS) ? 1 : UTCB_BR_COUNT;
+    uint64_t error = 0;
+
+    // Messages are truncated to the number of message registers
+    if (words >= UTCB_MR_COUNT)
+        words = UTCB_MR_COUNT - 1;
+
+    memcpy(to->utcb->mr, from->utcb->mr, (words + 1) * sizeof(uint64_t));
+
+    // Typed items are pairs of words after the untyped words
+    for (uint32_t i = untyped + 1; i + 1 <= words; i += 2)
+    {
+        uint64_t item = from->utcb->mr[i];
+        uint32_t type = item & IPC_ITEM_TYPE_MASK;
+
+        if ((type == IPC_ITEM_MAP || type == IPC_ITEM_GRANT) && from->space && to->space)
+        {
+            // If this fails the page is left unmapped and the receiver will fault on it again
+            MapFpageSend(from->space, from->utcb->mr[i + 1], item & ~0x3FFUL,
+                            to->space, to->utcb->br[0], type == IPC_ITEM_GRANT);
+        }
+        else if ((item & IPC_ITEM_STRING_MASK) == IPC_ITEM_STRING)
+        {
+            error = IpcTransferString(from, to, i, &buffer);
+            if (error)
+                break;
+        }
+
+        if (!(item & IPC_ITEM_CONTINUE))
+            break;
+    }
+
+    // The receiver finds the sender here
+    IpcWaitEnd(to);
+    to->senderId = from->id;
+
+    // Both threads get transfer errors (from their own point of view)
+    if (error == IPC_ERROR_XFER_INVOKER)
+        IpcError(to, IPC_ERROR_XFER_PARTNER, true);
+    else if (error == IPC_ERROR_XFER_PARTNER)
+        IpcError(to, IPC_ERROR_XFER_INVOKER, true);
+    else if (error)
+        IpcError(to, error, true);
+
+    return error;
+}
+
+// Returns true if thread runs on the current cpu
+static inline bool IpcIsLocal(Thread * thread)
+{
+    return thread->cpu == CpuCurrent();
+}
+
+// Posts thread's mail to the cpu running target
+//  There's no periodic tick to pick up requests, so the cpu is interrupted unless
+//  its mailbox already had something in it (and so has an interrupt on the way)
+static void IpcMailPost(Thread * thread, Thread * target)
+{
+    Cpu * cpu = target->cpu;
+
+    thread->mail.target = target;
+
+    if (ThreadMailPost(cpu, &thread->mail))
+        CpuSendIpi(cpu, INTR_APIC_RESCHEDULE);
+}
+
+// Starts the timeout of an IPC wait (if it's not infinite)
+static inline void IpcStartTimeout(Thread * thread, TimePeriod timeout)
+{
+    if (timeout != TIME_PEROID_INFINITE)
+        TimeEventAdd(&thread->timeout, TimeExpandPeriod(timeout));
+}
+
+// Finishes the send phase of a thread
+//  error = IPC error code or 0 if the message was delivered
+static void IpcSendComplete(Thread * sender, uint64_t error)
+{
+    if (!IpcIsLocal(sender))
+    {
+        // Send timeouts of threads on other cpus are run by this cpu
+        TimeEventCancel(&sender->timeout);
+
+        sender->mail.type = IPC_MAIL_COMPLETE;
+        sender->mail.error = error;
+        IpcMailPost(sender, sender);
+        return;
+    }
+
+    if (error)
+    {
+        sender->utcb->errorCode = error << 1;
+        sender->utcb->mr[0] = IPC_TAG_ERROR;
+        ThreadWake(sender);
+    }
+    else if (sender->state == THREAD_STATE_CALLING)
+    {
+        // Callers now wait for the reply
+        IpcWaitFrom(sender, sender->partner);
+        sender->state = THREAD_STATE_RECEIVING;
+        TimeEventCancel(&sender->timeout);
+        IpcStartTimeout(sender, sender->recvTimeout);
+    }
+    else
+    {
+        ThreadWake(sender);
+    }
+}
+
+// Returns the first thread waiting to send to thread (from = NULL for any thread)
+static Thread * IpcFindSender(Thread * thread, Thread * from)
+{
+    Thread * sender;
+
+    ListForEach(sender, &thread->senders, sendNode)
+    {
+        if (from == NULL || sender == from)
+            return sender;
+    }
+
+    return NULL;
+}
+
+// Receive phase of IPC
+//  If there is no message waiting and next is not NULL, next is run directly
+static bool IpcReceive(Thread * thread, Thread * from, Thread * next, bool block, TimePeriod timeout)
+{
+    Thread * sender = IpcFindSender(thread, from);
+
+    if (sender)
+    {
+        ListDelete(&sender->sendNode);
+        IpcSendComplete(sender, IpcTransfer(sender, thread));
+
+        if (next)
+            ThreadWake(next);
+
+        return thread->utcb->errorCode == 0;
+    }
+
+    if (!block)
+    {
+        if (next)
+            ThreadWake(next);
+
+        return IpcError(thread, IPC_ERROR_TIMEOUT, true);
+    }
+
+    // Wait for a message
+    IpcWaitFrom(thread, from);
+    IpcStartTimeout(thread, timeout);
+
+    if (next)
+    {
+        thread->state = THREAD_STATE_RECEIVING;
+        next->state = THREAD_STATE_RUNNING;
+        ThreadSwitch(next);
+    }
+    else
+    {
+        ThreadBlock(THREAD_STATE_RECEIVING);
+    }
+
+    // Threads switched to directly cancel their own timeouts
+    TimeEventCancel(&thread->timeout);
+    return thread->utcb->errorCode == 0;
+}
+
+bool IpcOperation(Thread * thread, Thread * to, Thread * from, uint32_t flags, uint32_t timeouts)
+{
+    uint64_t fromId = from ? from->id : THREAD_ID_NIL;
+    Thread * next = NULL;
+
+    thread->utcb->errorCode = 0;
+    thread->recvTimeout = (TimePeriod) timeouts;
+
+    if (flags & IPC_SEND)
+    {
+        if (!IpcIsLocal(to))
+        {
+            // The receiver's cpu does the send and tells us when it's finished
+            //  We always wait for that, even for non-blocking sends
+            //  It also runs the send timeout, so it can take the send off its queue
+            bool call = (flags & IPC_RECEIVE_BLOCK) && from == to;
+            TimePeriod timeout = (TimePeriod) (timeouts >> 16);
+
+            thread->partner = to;
+            thread->mail.type = IPC_MAIL_SEND;
+            thread->mail.flags = flags;
+            thread->mail.time = (timeout == TIME_PEROID_INFINITE) ? 0 : TimeExpandPeriod(timeout);
+            IpcMailPost(thread, to);
+            ThreadBlock(call ? THREAD_STATE_CALLING : THREAD_STATE_SENDING);
+            TimeEventCancel(&thread->timeout);
+
+            if (call || thread->utcb->errorCode)
+                return thread->utcb->errorCode == 0;
+        }
+        else if (IpcIsWaiting(to, thread))
+        {
+            // Send now (the receiver is resumed by the receive phase or below)
+            uint64_t error = IpcTransfer(thread, to);
+
+            next = to;
+            if (error)
+            {
+                ThreadWake(to);
+                return IpcError(thread, error, false);
+            }
+        }
+        else if (!(flags & IPC_SEND_BLOCK))
+        {
+            return IpcError(thread, IPC_ERROR_TIMEOUT, false);
+        }
+        else
+        {
+            // Wait for the receiver to pick up the message
+            //  If we're calling it, the receiver also sets us waiting for the reply
+            bool call = (flags & IPC_RECEIVE_BLOCK) && from == to;
+
+            thread->partner = to;
+            ListAddLast(&to->senders, &thread->sendNode);
+            IpcStartTimeout(thread, (TimePeriod) (timeouts >> 16));
+            ThreadBlock(call ? THREAD_STATE_CALLING : THREAD_STATE_SENDING);
+            TimeEventCancel(&thread->timeout);
+
+            if (call || thread->utcb->errorCode)
+                return thread->utcb->errorCode == 0;
+        }
+    }
+
+    // from may have been deleted while the send phase was blocked
+    if (from && ThreadLookup(fromId) != from)
+        return IpcError(thread, IPC_ERROR_NOT_EXIST, true);
+
+    if (flags & IPC_RECEIVE)
+        return IpcReceive(thread, from, next, flags & IPC_RECEIVE_BLOCK, (TimePeriod) timeouts);
+
+    if (next)
+        ThreadWake(next);
+
+    return true;
+}
+
+// Slow path of the Ipc system call (handles everything)
+static SyscallResult IpcSlowPath(Thread * thread, uint64_t toId, uint64_t fromId, uint64_t timeouts)
+{
+    Thread * to = NULL;
+    Thread * from = NULL;
+    uint32_t flags = 0;
+
+    if (toId != THREAD_ID_NIL)
+    {
+        to = ThreadLookup(toId);
+        if (to == NULL)
+        {
+            IpcError(thread, IPC_ERROR_NOT_EXIST, false);
+            return (SyscallResult) { THREAD_ID_NIL, thread->utcb->mr[0] };
+        }
+
+        flags |= IPC_SEND;
+        if ((TimePeriod) (timeouts >> 16) != TIME_PEROID_ZERO)
+            flags |= IPC_SEND_BLOCK;
+    }
+
+    if (fromId != THREAD_ID_NIL)
+    {
+        if (fromId != THREAD_ID_ANY)
+        {
+            from = ThreadLookup(fromId);
+            if (from == NULL)
+            {
+                IpcError(thread, IPC_ERROR_NOT_EXIST, true);
+                return (SyscallResult) { THREAD_ID_NIL, thread->utcb->mr[0] };
+            }
+        }
+
+        flags |= IPC_RECEIVE;
+        if ((TimePeriod) timeouts != TIME_PEROID_ZERO)
+            flags |= IPC_RECEIVE_BLOCK;
+    }
+
+    SyscallResult result = { THREAD_ID_NIL, 0 };
+
+    if (IpcOperation(thread, to, from, flags, (uint32_t) timeouts) && (flags & IPC_RECEIVE))
+        result.rax = thread->senderId;
+
+    result.rdx = thread->utcb->mr[0];
+
+    // Run the receiver now if it has a higher priority
+    SchedPreempt();
+    return result;
+}
+
+// Sends an untyped message to a waiting thread on this cpu and switches straight to it
+//  The current thread then waits for the reply (fromId = toId) or for any thread
+static inline SyscallResult IpcDirectSwitch(Thread * thread, Thread * to, uint64_t fromId, uint64_t tag)
+{
+    // Copy the message
+    uint32_t words = IPC_TAG_U(tag);
+
+    to->utcb->mr[0] = tag;
+    for (uint32_t i = 1; i <= words; i++)
+        to->utcb->mr[i] = thread->utcb->mr[i];
+
+    IpcWaitEnd(to);
+    to->senderId = thread->id;
+    to->utcb->errorCode = 0;
+    to->state = THREAD_STATE_RUNNING;
+
+    // Wait for the reply
+    thread->utcb->errorCode = 0;
+    IpcWaitFrom(thread, (fromId == THREAD_ID_ANY) ? NULL : to);
+    thread->state = THREAD_STATE_RECEIVING;
+    ThreadSwitch(to);
+
+    if (UNLIKELY(thread->utcb->errorCode))
+        return (SyscallResult) { THREAD_ID_NIL, thread->utcb->mr[0] };
+
+    return (SyscallResult) { thread->senderId, thread->utcb->mr[0] };
+}
+
+SyscallResult IpcSyscall(uint64_t toId, uint64_t fromId, uint64_t timeouts,
+                            uint64_t tag, UNUSED uint64_t a5, UNUSED uint64_t a6)
+{
+    Thread * thread = ThreadCurrent();
+
+    thread->utcb->mr[0] = tag;
+
+    // Fast path
+    //  Handles sending a short untyped message to a thread waiting for it, and then
+    //  waiting for the reply (call) or for any thread (reply and wait) with no timeout
+    //  This switches straight to the receiver without going near the scheduler
+    if (LIKELY((tag & IPC_FAST_TAG_MASK) == 0 &&
+                toId != THREAD_ID_NIL &&
+                (fromId == toId || fromId == THREAD_ID_ANY) &&
+                (TimePeriod) timeouts == TIME_PEROID_INFINITE))
+    {
+        Thread * to = ThreadLookup(toId);
+
+        if (LIKELY(to != NULL && to->cpu == thread->cpu && IpcIsWaiting(to, thread) &&
+                    (fromId == toId || ListIsEmpty(&thread->senders))))
+        {
+            return IpcDirectSwitch(thread, to, fromId, tag);
+        }
+    }
+
+    return IpcSlowPath(thread, toId, fromId, timeouts);
+}
+
+SyscallResult IpcLocalSyscall(uint64_t toId, uint64_t fromId, uint64_t timeouts,
+                                uint64_t tag, UNUSED uint64_t a5, UNUSED uint64_t a6)
+{
+    Thread * thread = ThreadCurrent();
+    Thread * to = NULL;
+    Thread * from = NULL;
+    SyscallResult result;
+
+    thread->utcb->mr[0] = tag;
+
+    // Lipc takes the local ids of threads in the caller's space
+    if (toId != THREAD_ID_NIL)
+    {
+        to = ThreadLookupLocal(thread->space, toId);
+        if (to == NULL)
+        {
+            IpcError(thread, IPC_ERROR_NOT_EXIST, false);
+            return (SyscallResult) { THREAD_ID_NIL, thread->utcb->mr[0] };
+        }
+    }
+
+    if (fromId == toId)
+    {
+        from = to;
+    }
+    else if (fromId != THREAD_ID_NIL && fromId != THREAD_ID_ANY)
+    {
+        from = ThreadLookupLocal(thread->space, fromId);
+        if (from == NULL)
+        {
+            IpcError(thread, IPC_ERROR_NOT_EXIST, true);
+            return (SyscallResult) { THREAD_ID_NIL, thread->utcb->mr[0] };
+        }
+    }
+
+    // Local messages can contain any number of untyped words, and since both threads
+    //  share an address space, ThreadSwitch doesn't touch the page tables
+    if (LIKELY(to != NULL && to->cpu == thread->cpu &&
+                (tag & IPC_LOCAL_TAG_MASK) == 0 &&
+                (from == to || fromId == THREAD_ID_ANY) &&
+                (TimePeriod) timeouts == TIME_PEROID_INFINITE &&
+                IpcIsWaiting(to, thread) &&
+                (from == to || ListIsEmpty(&thread->senders))))
+    {
+        result = IpcDirectSwitch(thread, to, from ? to->id : THREAD_ID_ANY, tag);
+    }
+    else
+    {
+        // Anything else is done like a normal IPC
+        result = IpcSlowPath(thread, to ? to->id : THREAD_ID_NIL,
+                                from ? from->id : fromId, timeouts);
+    }
+
+    // Senders in the same space are returned by their local ids
+    Thread * sender = ThreadLookup(result.rax);
+
+    if (sender && sender->space == thread->space)
+        result.rax = sender->localId;
+
+    return result;
+}
+
+bool IpcCancel(Thread * thread)
+{
+    Thread * sender;
+
+    // Finish any requests from other cpus first
+    IpcMailboxProcess();
+
+    if (thread->state == THREAD_STATE_SENDING || thread->state == THREAD_STATE_CALLING)
+    {
+        if (!IpcIsLocal(thread->partner))
+            return false;
+
+        ListDelete(&thread->sendNode);
+    }
+    else if (thread->state == THREAD_STATE_RECEIVING)
+    {
+        IpcWaitEnd(thread);
+    }
+
+    TimeEventCancel(&thread->timeout);
+
+    ListForEachSafe(sender, tmp, &thread->senders, sendNode)
+    {
+        ListDelete(&sender->sendNode);
+        IpcSendComplete(sender, IPC_ERROR_CANCELED);
+    }
+
+    thread->state = THREAD_STATE_INACTIVE;
+    thread->partner = NULL;
+    return true;
+}
+
+// Aborts the closed receives from a deleted thread by threads on this cpu
+//  (sends to it have been completed by IpcCancel or its cpu's mailbox)
+static void IpcForget(Thread * deleted)
+{
+    Cpu * cpu = CpuCurrent();
+    List aborted;
+    Thread * thread;
+
+    // Receiving threads don't change cpus, and the ones on this cpu can't stop waiting
+    //  until we've finished
+    ListInit(&aborted);
+    AtomicLock(&deleted->receiversLock);
+
+    ListForEachSafe(thread, tmp, &deleted->receivers, recvNode)
+    {
+        if (thread->cpu == cpu)
+        {
+            ListDelete(&thread->recvNode);
+            ListAddLast(&aborted, &thread->recvNode);
+        }
+    }
+
+    AtomicUnlock(&deleted->receiversLock);
+
+    ListForEachSafe(thread, tmp, &aborted, recvNode)
+    {
+        ListDelete(&thread->recvNode);
+        IpcError(thread, IPC_ERROR_CANCELED, true);
+        thread->partner = NULL;
+        ThreadWake(thread);
+    }
+}
+
+// Posts a deleted thread's request to the next cpu
+//  It visits each cpu in turn before getting back to the thread's own cpu
+static void IpcDeletePost(Thread * thread)
+{
+    Cpu * next = CpuList[(CpuCurrent()->id + 1) % CpuCount];
+
+    thread->mail.type = IPC_MAIL_DELETE;
+    thread->mail.target = thread;
+
+    if (ThreadMailPost(next, &thread->mail))
+        CpuSendIpi(next, INTR_APIC_RESCHEDULE);
+}
+
+void IpcDelete(Thread * thread)
+{
+    IpcForget(thread);
+    IpcDeletePost(thread);
+}
+
+void IpcTimeout(TimeEvent * event)
+{
+    Thread * thread = ListGet(event, Thread, timeout);
+
+    if (thread->state == THREAD_STATE_RECEIVING)
+    {
+        IpcWaitEnd(thread);
+        IpcError(thread, IPC_ERROR_TIMEOUT, true);
+        ThreadWake(thread);
+    }
+    else if (IpcIsLocal(thread->partner))
+    {
+        // Send timeouts run on the receiver's cpu (if the receiver has moved since
+        //  then the send carries on)
+        ListDelete(&thread->sendNode);
+        IpcSendComplete(thread, IPC_ERROR_TIMEOUT);
+    }
+}
+
+void IpcMigrate(Thread * thread)
+{
+    Thread * sender;
+
+    // Timeouts are in this cpu's timer wheel, which the new cpu can't touch
+    ListForEach(sender, &thread->senders, sendNode)
+        TimeEventCancel(&sender->timeout);
+}
+
+void IpcMailboxProcess(void)
+{
+    ThreadMail * mail = ThreadMailTake();
+
+    while (mail)
+    {
+        // The mail may be reused as soon as it's handled
+        ThreadMail * next = mail->next;
+        Thread * thread = ListGet(mail, Thread, mail);
+        Thread * to = mail->target;
+
+        if (mail->type >= SCHED_MAIL_FIRST)
+        {
+            SchedMailHandle(thread);
+        }
+        else if (mail->type == IPC_MAIL_COMPLETE)
+        {
+            IpcSendComplete(thread, mail->error);
+        }
+        else if (mail->type == IPC_MAIL_DELETE)
+        {
+            // Mail sent to the thread before every cpu forgot it has been handled by
+            //  the time this gets back to its cpu (mailboxes are handled in order)
+            if (IpcIsLocal(thread))
+            {
+                ThreadFree(thread);
+            }
+            else
+            {
+                IpcForget(thread);
+                IpcDeletePost(thread);
+            }
+        }
+        else if (to->id == THREAD_ID_NIL)
+        {
+            // The receiver was deleted after this was posted
+            IpcSendComplete(thread, IPC_ERROR_NOT_EXIST);
+        }
+        else if (!IpcIsLocal(to))
+        {
+            // The receiver moved to another cpu after this was posted
+            IpcMailPost(thread, to);
+        }
+        else if (IpcIsWaiting(to, thread))
+        {
+            uint64_t error = IpcTransfer(thread, to);
+
+            ThreadWake(to);
+            IpcSendComplete(thread, error);
+        }
+        else if (mail->flags & IPC_SEND_BLOCK)
+        {
+            // The receiver completes the send when it picks up the message
+            //  The timeout is ours to run (see IpcSendComplete and IpcMigrate)
+            ListAddLast(&to->senders, &thread->sendNode);
+
+            if (mail->time)
+                TimeEventAdd(&thread->timeout, mail->time);
+        }
+        else
+        {
+            IpcSendComplete(thread, IPC_ERROR_TIMEOUT);
+        }
+
+        mail = next;
+    }
+}
+
+void IpcPageFault(Thread * thread, uint64_t addr, uint64_t ip, uint32_t access)
+{
+    Thread * pager = ThreadLookup(thread->pager);
+
+    // Threads without pagers (or UTCBs to hold the message) are stopped
+    if (pager == NULL || thread->utcb == NULL)
+    {
+        ThreadBlock(THREAD_STATE_INACTIVE);
+        return;
+    }
+
+    // Save the registers overwritten by the fault message
+    //  The reply should only contain a map item (which uses the same registers)
+    uint64_t savedMrs[3];
+    uint64_t savedAcceptor = thread->utcb->br[0];
+
+    memcpy(savedMrs, thread->utcb->mr, sizeof(savedMrs));
+
+    thread->utcb->mr[0] = IpcTagCreate(IPC_LABEL_PAGEFAULT | access, 2, 0);
+    thread->utcb->mr[1] = addr;
+    thread->utcb->mr[2] = ip;
+    thread->utcb->br[0] = MAP_FPAGE_COMPLETE;
+
+    // The pager's reply installs the mapping and switches straight back to us
+    bool success = IpcCall(thread, pager);
+
+    memcpy(thread->utcb->mr, savedMrs, sizeof(savedMrs));
+    thread->utcb->br[0] = savedAcceptor;
+
+    // Retrying the access would fault again, so the thread is stopped like one
+    //  without a pager (the error is left in the UTCB)
+    if (!success)
+        ThreadBlock(THREAD_STATE_INACTIVE);
+}
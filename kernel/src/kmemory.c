@@ -21,72 +21,1005 @@
 #include "global.h"
 #include "kmemory.h"
 #include "atomic.h"
+#include "cpu.h"
+#include "cpupriv.h"
+#include "list.h"
 
-// Root of the memory stack
-static void * KMemStackRoot;
+// Page state stored for pages which are not the first page of a free block
+//  The first page of a free block stores the order of the block
+#define KMEM_PAGE_USED  0xFF
 
-// Spinlock for the stack root
-static AtomicSpinlock KMemStackLock;
+// Default distances between nodes if there is no SLIT
+#define KMEM_LOCAL_DISTANCE     10
+#define KMEM_REMOTE_DISTANCE    20
 
-void * KMemAllocate(void)
+// Maximum number of node memory ranges
+#define KMEM_MAX_NODE_RANGES    64
+
+// Allocator data for one NUMA node
+typedef struct KMemNode
+{
+    AtomicSpinlock lock;                    // Lock protecting the free lists
+    List freeLists[KMEM_MAX_ORDER + 1];     // Lists of free blocks for each order
+    uint32_t fallback[KMEM_MAX_NODES];      // Nodes to allocate from (nearest first)
+
+    uint64_t totalPages;                    // Pages given to this node
+    uint64_t freePages;                     // Pages in the free lists
+    uint64_t lowFreePages;                  // Lowest value of freePages
+
+} ALIGN(64) KMemNode;
+
+// State of every page managed by the allocator (indexed by pfn - KMemFirstPfn)
+static uint8_t * KMemPageState;
+
+// Node of every page managed by the allocator (indexed by pfn - KMemFirstPfn)
+static uint8_t * KMemPageNode;
+
+// Range of page frame numbers managed by the allocator [first, last)
+static uint64_t KMemFirstPfn;
+static uint64_t KMemLastPfn;
+
+// NUMA nodes
+uint32_t KMemNodeCount = 1;
+static KMemNode KMemNodes[KMEM_MAX_NODES];
+static uint8_t KMemNodeDistance[KMEM_MAX_NODES][KMEM_MAX_NODES];
+
+// Memory ranges belonging to each node (from the ACPI SRAT)
+static struct
+{
+    uint64_t base;
+    uint64_t end;
+    uint32_t node;
+
+} KMemNodeRanges[KMEM_MAX_NODE_RANGES];
+
+static uint32_t KMemNodeRangeCount;
+
+// List of physical memory regions
+KMemRegion KMemRegions[KMEM_MAX_REGIONS];
+uint32_t KMemRegionCount;
+uint64_t KMemPhysicalEnd;
+
+// Physical start and end of the kernel image (from the linker script)
+extern char KernelPhysicalStart[], KernelPhysicalEnd[];
+
+// Stack of pre-zeroed pages (linked through the first word of each page)
+static void * KMemZeroRoot;
+static volatile uint32_t KMemZeroCount;
+static AtomicSpinlock KMemZeroLock;
+
+// True once the per-cpu caches can be used
+static bool KMemCpuCacheEnabled;
+
+#ifdef CONFIG_KMEM_DEBUG
+// Owner of an allocated block (stored for the first page of the block)
+typedef struct KMemOwner
 {
-    void * newPage;
+    void * caller;                          // Return address of the allocation
+    uint64_t order;                         // Order of the block
+
+} KMemOwner;
+
+// Owners of every page managed by the allocator (indexed by pfn - KMemFirstPfn)
+static KMemOwner * KMemOwners;
+#endif
 
-    // Enter lock
-    AtomicLock(&KMemStackLock);
+// Converts between page frame numbers and pointers
+static inline uint64_t KMemToPfn(void * ptr)
+{
+    return KMemToPhysical(ptr) >> 12;
+}
+
+static inline void * KMemFromPfn(uint64_t pfn)
+{
+    return (void *) (KMEM_PHYSICAL_BASE + (pfn << 12));
+}
+
+// Enters an allocator lock, counting the spins in the cpu's statistics
+static inline void KMemLock(AtomicSpinlock * lock, Cpu * cpu)
+{
+    while (!AtomicTryLock(lock))
     {
-        // Pop one item off the stack
-        newPage = KMemStackRoot;
+        do
+        {
+            AtomicPause();
 
-        if (newPage != NULL)
-            KMemStackRoot = *((void **) KMemStackRoot);
+            if (cpu)
+                cpu->kmemCache.lockSpins++;
+        }
+        while (lock->data);
     }
-    AtomicUnlock(&KMemStackLock);
+}
 
-    return newPage;
+#ifdef CONFIG_KMEM_DEBUG
+// Records the caller which allocated a block
+static inline void KMemTag(void * block, uint32_t order, void * caller)
+{
+    if (block != NULL)
+    {
+        KMemOwner * owner = &KMemOwners[KMemToPfn(block) - KMemFirstPfn];
+
+        owner->caller = caller;
+        owner->order = order;
+    }
+}
+
+// Forgets the owner of a block when it is freed
+//  This catches double frees and frees with the wrong order
+static inline void KMemUntag(void * block, uint32_t order)
+{
+    KMemOwner * owner = &KMemOwners[KMemToPfn(block) - KMemFirstPfn];
+
+    Assert(owner->caller != NULL && owner->order == order);
+    owner->caller = NULL;
+}
+
+# define KMEM_TAG(block, order) KMemTag(block, order, __builtin_return_address(0))
+# define KMEM_UNTAG(block, order) KMemUntag(block, order)
+#else
+# define KMEM_TAG(block, order) ((void) 0)
+# define KMEM_UNTAG(block, order) ((void) 0)
+#endif
+
+// Inserts a free block into the free lists
+//  Node lock must be held
+static void KMemBuddyInsert(KMemNode * node, uint64_t pfn, uint32_t order)
+{
+    KMemPageState[pfn - KMemFirstPfn] = order;
+    ListAddFirst(&node->freeLists[order], KMemFromPfn(pfn));
+}
+
+// Allocates a block of the given order
+//  Node lock must be held
+static void * KMemBuddyAllocate(KMemNode * node, uint32_t order)
+{
+    // Find the smallest free block which is large enough
+    uint32_t current = order;
+
+    while (ListIsEmpty(&node->freeLists[current]))
+    {
+        if (++current > KMEM_MAX_ORDER)
+            return NULL;
+    }
+
+    // Remove it from the free list
+    ListNode * block = node->freeLists[current].sentinal.next;
+    uint64_t pfn = KMemToPfn(block);
+
+    ListDelete(block);
+    KMemPageState[pfn - KMemFirstPfn] = KMEM_PAGE_USED;
+
+    node->freePages -= 1UL << order;
+    if (node->freePages < node->lowFreePages)
+        node->lowFreePages = node->freePages;
+
+    // Split the block until it's the right size, freeing the upper halves
+    while (current > order)
+    {
+        current--;
+        KMemBuddyInsert(node, pfn + (1UL << current), current);
+    }
+
+    return block;
+}
+
+// Frees a block of the given order, merging it with its buddies
+//  Node lock must be held
+static void KMemBuddyFree(KMemNode * node, uint64_t pfn, uint32_t order)
+{
+    uint8_t nodeId = KMemPageNode[pfn - KMemFirstPfn];
+
+    node->freePages += 1UL << order;
+
+    while (order < KMEM_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1UL << order);
+
+        // Stop if the buddy isn't a free block of the same size in the same node
+        //  The node must be checked first since other nodes' states aren't locked
+        if (buddy < KMemFirstPfn || buddy >= KMemLastPfn ||
+            KMemPageNode[buddy - KMemFirstPfn] != nodeId ||
+            KMemPageState[buddy - KMemFirstPfn] != order)
+        {
+            break;
+        }
+
+        // Merge with buddy
+        ListDelete(KMemFromPfn(buddy));
+        KMemPageState[buddy - KMemFirstPfn] = KMEM_PAGE_USED;
+
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    KMemBuddyInsert(node, pfn, order);
+}
+
+// Frees all the pages in the range [first, last) splitting them into aligned blocks
+//  All the pages must be in the given node and its lock must be held
+static void KMemBuddyFreeRange(KMemNode * node, uint64_t first, uint64_t last)
+{
+    while (first < last)
+    {
+        // Find largest aligned block starting here
+        uint32_t order = 0;
+
+        while (order < KMEM_MAX_ORDER &&
+                (first & (1UL << order)) == 0 &&
+                first + (2UL << order) <= last)
+        {
+            order++;
+        }
+
+        KMemBuddyFree(node, first, order);
+        first += 1UL << order;
+    }
+}
+
+// Returns the node containing the given page
+static inline KMemNode * KMemNodeOf(uint64_t pfn)
+{
+    return &KMemNodes[KMemPageNode[pfn - KMemFirstPfn]];
+}
+
+// Returns the current cpu or NULL if the per-cpu caches aren't usable yet
+//  The kernel is not preemptible so the cache can't change cpus under us
+static inline Cpu * KMemCurrentCpu(void)
+{
+    if (!KMemCpuCacheEnabled)
+        return NULL;
+
+    return CpuCurrent();
+}
+
+// Returns a block directly to its node
+static void KMemFreeBlock(void * block, uint32_t order, Cpu * cpu)
+{
+    uint64_t pfn = KMemToPfn(block);
+    KMemNode * node = KMemNodeOf(pfn);
+
+    KMemLock(&node->lock, cpu);
+    KMemBuddyFree(node, pfn, order);
+    AtomicUnlock(&node->lock);
+}
+
+// Returns the pages in the zero pool to their nodes
+//  Otherwise they could only be used by KMemZAllocate, even when everything else has run out
+//  Returns false if the pool was empty
+static bool KMemZeroDrain(Cpu * cpu)
+{
+    void * page;
+
+    if (KMemZeroCount == 0)
+        return false;
+
+    KMemLock(&KMemZeroLock, cpu);
+    {
+        page = KMemZeroRoot;
+        KMemZeroRoot = NULL;
+        KMemZeroCount = 0;
+    }
+    AtomicUnlock(&KMemZeroLock);
+
+    if (page == NULL)
+        return false;
+
+    while (page != NULL)
+    {
+        void * next = *((void **) page);
+
+        // Pool pages were counted as allocations when they were zeroed
+        if (cpu)
+            cpu->kmemCache.frees++;
+
+        KMEM_UNTAG(page, 0);
+        KMemFreeBlock(page, 0, cpu);
+        page = next;
+    }
+
+    return true;
+}
+
+// Allocates a block from the nearest node with one free (the block is not tagged)
+//  If drain is true and every node is out of memory, the zero pool is given back first
+static void * KMemNodesAllocate(uint32_t order, uint32_t nodeId, Cpu * cpu, bool drain)
+{
+    do
+    {
+        // Try each node, starting with the nearest
+        for (uint32_t i = 0; i < KMemNodeCount; i++)
+        {
+            KMemNode * node = &KMemNodes[KMemNodes[nodeId].fallback[i]];
+            void * block;
+
+            KMemLock(&node->lock, cpu);
+            block = KMemBuddyAllocate(node, order);
+            AtomicUnlock(&node->lock);
+
+            if (block != NULL)
+            {
+                if (cpu)
+                    cpu->kmemCache.allocations++;
+
+                return block;
+            }
+        }
+    }
+    while (drain && KMemZeroDrain(cpu));
+
+    return NULL;
+}
+
+void * KMemAllocateOrderNode(uint32_t order, uint32_t nodeId)
+{
+    Assert(order <= KMEM_MAX_ORDER);
+    Assert(nodeId < KMemNodeCount);
+
+    void * block = KMemNodesAllocate(order, nodeId, KMemCurrentCpu(), true);
+
+    KMEM_TAG(block, order);
+    return block;
+}
+
+void * KMemAllocateOrder(uint32_t order)
+{
+    Cpu * cpu = KMemCurrentCpu();
+    void * block = KMemAllocateOrderNode(order, cpu ? cpu->node : 0);
+
+    KMEM_TAG(block, order);
+    return block;
+}
+
+void KMemFreeOrder(void * block, uint32_t order)
+{
+    // Ignore NULL free
+    if (block == NULL)
+        return;
+
+    Assert(order <= KMEM_MAX_ORDER);
+    Assert((KMemToPhysical(block) & ((0x1000UL << order) - 1)) == 0);
+
+    Cpu * cpu = KMemCurrentCpu();
+
+    if (cpu)
+        cpu->kmemCache.frees++;
+
+    KMEM_UNTAG(block, order);
+    KMemFreeBlock(block, order, cpu);
+}
+
+// Allocates one page (which is not tagged)
+//  If drain is true and memory has run out, the zero pool is given back first
+static void * KMemAllocatePage(bool drain)
+{
+    Cpu * cpu = KMemCurrentCpu();
+
+    // Use the global allocator if there is no cache
+    if (cpu == NULL)
+        return KMemNodesAllocate(0, 0, NULL, drain);
+
+    KMemCpuCache * cache = &cpu->kmemCache;
+
+    do
+    {
+        // Refill the cache if it's empty (starting with the nearest node)
+        for (uint32_t i = 0; cache->count == 0 && i < KMemNodeCount; i++)
+        {
+            KMemNode * node = &KMemNodes[KMemNodes[cpu->node].fallback[i]];
+
+            KMemLock(&node->lock, cpu);
+            {
+                while (cache->count < KMEM_CPU_CACHE_BATCH)
+                {
+                    void * page = KMemBuddyAllocate(node, 0);
+                    if (page == NULL)
+                        break;
+
+                    cache->pages[cache->count++] = page;
+                }
+            }
+            AtomicUnlock(&node->lock);
+        }
+    }
+    while (cache->count == 0 && drain && KMemZeroDrain(cpu));
+
+    if (cache->count == 0)
+        return NULL;
+
+    // Pop a page from the cache
+    void * page = cache->pages[--cache->count];
+
+    cache->allocations++;
+    return page;
+}
+
+void * KMemAllocate(void)
+{
+    void * page = KMemAllocatePage(true);
+
+    KMEM_TAG(page, 0);
+    return page;
 }
 
 void * KMemZAllocate(void)
 {
-    // Allocate memory and zero it
-    void * newPage = KMemAllocate();
+    Cpu * cpu = KMemCurrentCpu();
+    void * newPage = NULL;
+
+    // Try the zero pool first
+    if (KMemZeroCount > 0)
+    {
+        KMemLock(&KMemZeroLock, cpu);
+        {
+            newPage = KMemZeroRoot;
+
+            if (newPage != NULL)
+            {
+                KMemZeroRoot = *((void **) newPage);
+                KMemZeroCount--;
+            }
+        }
+        AtomicUnlock(&KMemZeroLock);
+    }
 
     if (newPage != NULL)
-        memset(newPage, 0, 4096);
+    {
+        // Only the link needs clearing
+        *((void **) newPage) = NULL;
+
+        if (cpu)
+            cpu->kmemCache.zeroHits++;
+    }
+    else
+    {
+        // Allocate memory and zero it
+        newPage = KMemAllocate();
+
+        if (newPage != NULL)
+            memset(newPage, 0, 4096);
 
+        if (cpu)
+            cpu->kmemCache.zeroMisses++;
+    }
+
+    // Pool pages were counted as allocations when they were zeroed
+    KMEM_TAG(newPage, 0);
     return newPage;
 }
 
+bool KMemZeroIdle(void)
+{
+    // Racy check (it doesn't matter if the pool grows slightly too large)
+    if (KMemZeroCount >= KMEM_ZERO_POOL_SIZE)
+        return false;
+
+    // Allocating would drain the pool if memory has run out, so don't
+    void * page = KMemAllocatePage(false);
+    if (page == NULL)
+        return false;
+
+    KMEM_TAG(page, 0);
+
+    // Zero the page outside the lock
+    memset(page, 0, 4096);
+
+    KMemLock(&KMemZeroLock, KMemCurrentCpu());
+    {
+        *((void **) page) = KMemZeroRoot;
+        KMemZeroRoot = page;
+        KMemZeroCount++;
+    }
+    AtomicUnlock(&KMemZeroLock);
+
+    return true;
+}
+
+void KMemGetStats(KMemStats * stats)
+{
+    memset(stats, 0, sizeof(KMemStats));
+
+    for (uint32_t i = 0; i < KMemNodeCount; i++)
+    {
+        KMemNode * node = &KMemNodes[i];
+
+        stats->totalPages += node->totalPages;
+        stats->freePages += node->freePages;
+        stats->peakUsedPages += node->totalPages - node->lowFreePages;
+    }
+
+    stats->zeroPages = KMemZeroCount;
+
+    for (uint32_t i = 0; i < CpuCount; i++)
+    {
+        KMemCpuCache * cache = &CpuList[i]->kmemCache;
+
+        stats->cachedPages += cache->count;
+        stats->allocations += cache->allocations;
+        stats->frees += cache->frees;
+        stats->lockSpins += cache->lockSpins;
+        stats->zeroHits += cache->zeroHits;
+        stats->zeroMisses += cache->zeroMisses;
+    }
+}
+
+#ifdef CONFIG_KMEM_DEBUG
+void KMemDumpAllocations(KMemDumpCallback callback)
+{
+    for (uint64_t pfn = KMemFirstPfn; pfn < KMemLastPfn; pfn++)
+    {
+        KMemOwner * owner = &KMemOwners[pfn - KMemFirstPfn];
+
+        if (owner->caller != NULL)
+            callback(KMemFromPfn(pfn), owner->order, owner->caller);
+    }
+}
+#endif
+
 void KMemFree(void * page)
 {
     // Ignore NULL free
     if (page == NULL)
         return;
 
-    // Enter lock
-    AtomicLock(&KMemStackLock);
+    Cpu * cpu = KMemCurrentCpu();
+
+    KMEM_UNTAG(page, 0);
+
+    // Use the global allocator if there is no cache
+    if (cpu == NULL)
+    {
+        KMemFreeBlock(page, 0, NULL);
+        return;
+    }
+
+    KMemCpuCache * cache = &cpu->kmemCache;
+
+    cache->frees++;
+
+    // Drain the oldest pages from the cache if it's full
+    //  The cache holds two batches so the memcpy regions never overlap
+    if (cache->count == KMEM_CPU_CACHE_SIZE)
+    {
+        // Each page is returned to its own node
+        //  Pages are usually from the same node so the lock is only switched when needed
+        KMemNode * locked = NULL;
+
+        for (uint32_t i = 0; i < KMEM_CPU_CACHE_BATCH; i++)
+        {
+            uint64_t pfn = KMemToPfn(cache->pages[i]);
+            KMemNode * node = KMemNodeOf(pfn);
+
+            if (node != locked)
+            {
+                if (locked)
+                    AtomicUnlock(&locked->lock);
+
+                KMemLock(&node->lock, cpu);
+                locked = node;
+            }
+
+            KMemBuddyFree(node, pfn, 0);
+        }
+
+        AtomicUnlock(&locked->lock);
+
+        cache->count -= KMEM_CPU_CACHE_BATCH;
+        memcpy(cache->pages, cache->pages + KMEM_CPU_CACHE_BATCH,
+                cache->count * sizeof(void *));
+    }
+
+    // Push the page onto the cache
+    cache->pages[cache->count++] = page;
+}
+
+void KMemCpuCacheInit(KMemCpuCache * cache)
+{
+    cache->count = 0;
+    cache->allocations = 0;
+    cache->frees = 0;
+    cache->lockSpins = 0;
+    cache->zeroHits = 0;
+    cache->zeroMisses = 0;
+}
+
+void KMemCpuCacheEnable(void)
+{
+    KMemCpuCacheEnabled = true;
+}
+
+// Finds a slot for a new region when the region list is full
+//  Returns NULL if the region was merged into another or should be dropped
+static KMemRegion * KMemRegionMakeRoom(uint64_t base, uint64_t end, uint32_t type,
+                                        uint32_t firmwareType)
+{
+    KMemRegion * reserved = NULL;
+    KMemRegion * smallest = NULL;
+
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
+    {
+        KMemRegion * region = &KMemRegions[i];
+
+        // Reuse regions emptied by KMemRegionReserve
+        if (region->base >= region->end)
+            return region;
+
+        // Merge with a touching region of the same type
+        if (region->type == type && region->firmwareType == firmwareType &&
+            region->end >= base && region->base <= end)
+        {
+            if (base < region->base)
+                region->base = base;
+            if (end > region->end)
+                region->end = end;
+
+            return NULL;
+        }
+
+        if (region->type == KMEM_REGION_RESERVED)
+            reserved = region;
+        else if (region->type == KMEM_REGION_USABLE &&
+                (smallest == NULL || region->end - region->base < smallest->end - smallest->base))
+            smallest = region;
+    }
+
+    // Firmware reserved regions are never allocated from, so losing one only
+    //  removes its descriptor from the info page. Anything else is more important.
+    if (type == KMEM_REGION_RESERVED)
+        return NULL;
+    else if (reserved)
+        return reserved;
+
+    // Otherwise keep the largest usable regions
+    if (type == KMEM_REGION_USABLE && smallest &&
+        smallest->end - smallest->base < end - base)
+    {
+        return smallest;
+    }
+
+    return NULL;
+}
+
+// Adds a region to the end of the region list
+//  If the list is full, the region is merged with another or the least important one is dropped
+static void KMemRegionAdd(uint64_t base, uint64_t end, uint32_t type, uint32_t firmwareType)
+{
+    KMemRegion * region;
+
+    if (base >= end)
+        return;
+
+    if (KMemRegionCount < KMEM_MAX_REGIONS)
+        region = &KMemRegions[KMemRegionCount++];
+    else if ((region = KMemRegionMakeRoom(base, end, type, firmwareType)) == NULL)
+        return;
+
+    region->base = base;
+    region->end = end;
+    region->type = type;
+    region->firmwareType = firmwareType;
+}
+
+// Removes the range [base, end) from all usable regions and adds it as a kernel region
+//  The range is expanded to page boundaries
+static void KMemRegionReserve(uint64_t base, uint64_t end)
+{
+    base &= ~0xFFFUL;
+    end = (end + 0xFFF) & ~0xFFFUL;
+
+    // Only the original regions need checking (the split regions are added after them)
+    uint32_t count = KMemRegionCount;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        KMemRegion * region = &KMemRegions[i];
+
+        if (region->type != KMEM_REGION_USABLE || end <= region->base || base >= region->end)
+            continue;
+
+        // Trim the part below the range and split off the part above it
+        uint64_t regionEnd = region->end;
+
+        if (base > region->base)
+            region->end = base;
+        else
+            region->end = region->base;
+
+        KMemRegionAdd(end, regionEnd, KMEM_REGION_USABLE, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+
+    KMemRegionAdd(base, end, KMEM_REGION_KERNEL, 0);
+}
+
+// Removes empty regions and sorts the region list
+static void KMemRegionSort(void)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
+    {
+        KMemRegion region = KMemRegions[i];
+
+        if (region.base >= region.end)
+            continue;
+
+        // Insertion sort by base address
+        uint32_t j = count++;
+        for (; j > 0 && KMemRegions[j - 1].base > region.base; j--)
+            KMemRegions[j] = KMemRegions[j - 1];
+
+        KMemRegions[j] = region;
+    }
+
+    KMemRegionCount = count;
+}
+
+// Builds the region list from the multiboot information
+static void KMemRegionsFromMultiboot(MultibootInfo * bootInfo)
+{
+    if (bootInfo->flags & MULTIBOOT_INFO_MEM_MAP)
+    {
+        // Read the full memory map
+        char * mmapPtr = KMemFromPhysical(bootInfo->mmap_addr);
+        char * mmapEnd = mmapPtr + bootInfo->mmap_length;
+
+        while (mmapPtr < mmapEnd)
+        {
+            MultibootMmapEntry * entry = (MultibootMmapEntry *) mmapPtr;
+
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            {
+                // Only use whole pages of usable memory
+                uint64_t base = (entry->addr + 0xFFF) & ~0xFFFUL;
+                uint64_t end = (entry->addr + entry->len) & ~0xFFFUL;
+
+                KMemRegionAdd(base, end, KMEM_REGION_USABLE, entry->type);
+            }
+            else
+            {
+                KMemRegionAdd(entry->addr, entry->addr + entry->len,
+                                KMEM_REGION_RESERVED, entry->type);
+            }
+
+            // The size field does not include itself
+            mmapPtr += entry->size + sizeof(entry->size);
+        }
+    }
+    else if (bootInfo->flags & MULTIBOOT_INFO_MEMORY)
+    {
+        // Only the amount of lower and upper memory is available (in KB)
+        KMemRegionAdd(0, (bootInfo->mem_lower << 10) & ~0xFFFUL,
+                        KMEM_REGION_USABLE, MULTIBOOT_MEMORY_AVAILABLE);
+        KMemRegionAdd(0x100000, (0x100000 + (bootInfo->mem_upper << 10)) & ~0xFFFUL,
+                        KMEM_REGION_USABLE, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+    else
+    {
+        Panic("Bootloader did not provide a memory map");
+    }
+
+    // Reserve the real mode IVT and BIOS data area
+    KMemRegionReserve(0, 0x1000);
+
+    // Reserve the AP startup code
+    KMemRegionReserve(CPU_LOW_INIT_LOC, CPU_LOW_INIT_LOC + (CpuLowerInitEnd - CpuLowerInit));
+
+    // Reserve the kernel image (including the boot stack and paging tables)
+    KMemRegionReserve((uint64_t) KernelPhysicalStart, (uint64_t) KernelPhysicalEnd);
+
+    // Reserve the multiboot information which may be used later
+    uint64_t bootInfoAddr = (uint64_t) bootInfo & 0x7FFFFFFF;
+    KMemRegionReserve(bootInfoAddr, bootInfoAddr + sizeof(MultibootInfo));
+
+    if (bootInfo->flags & MULTIBOOT_INFO_MEM_MAP)
+        KMemRegionReserve(bootInfo->mmap_addr, bootInfo->mmap_addr + bootInfo->mmap_length);
+
+    if (bootInfo->flags & MULTIBOOT_INFO_MODS)
+    {
+        MultibootModList * mods = KMemFromPhysical(bootInfo->mods_addr);
+
+        KMemRegionReserve(bootInfo->mods_addr,
+                            bootInfo->mods_addr + bootInfo->mods_count * sizeof(MultibootModList));
+
+        for (uint32_t i = 0; i < bootInfo->mods_count; i++)
+            KMemRegionReserve(mods[i].mod_start, mods[i].mod_end);
+    }
+
+    KMemRegionSort();
+}
+
+// Frees the parts of all the usable regions inside [start, end)
+static void KMemFreeUsable(uint64_t start, uint64_t end)
+{
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
     {
-        // Push this page onto the stack
-        *((void **) page) = KMemStackRoot;
-        KMemStackRoot = page;
+        KMemRegion * region = &KMemRegions[i];
+
+        if (region->type != KMEM_REGION_USABLE || region->base >= end || region->end <= start)
+            continue;
+
+        uint64_t pfn = (region->base > start ? region->base : start) >> 12;
+        uint64_t lastPfn = (region->end < end ? region->end : end) >> 12;
+
+        while (pfn < lastPfn)
+        {
+            // Free the run of pages in the same node
+            uint8_t nodeId = KMemPageNode[pfn - KMemFirstPfn];
+            uint64_t runEnd = pfn + 1;
+
+            while (runEnd < lastPfn && KMemPageNode[runEnd - KMemFirstPfn] == nodeId)
+                runEnd++;
+
+            KMemNode * node = &KMemNodes[nodeId];
+
+            AtomicLock(&node->lock);
+            {
+                KMemBuddyFreeRange(node, pfn, runEnd);
+
+                // New memory doesn't change the peak usage
+                node->totalPages += runEnd - pfn;
+                node->lowFreePages += runEnd - pfn;
+            }
+            AtomicUnlock(&node->lock);
+
+            pfn = runEnd;
+        }
+    }
+}
+
+// Initializes the nodes and builds their fallback lists
+static void KMemInitNodes(void)
+{
+    for (uint32_t i = 0; i < KMemNodeCount; i++)
+    {
+        KMemNode * node = &KMemNodes[i];
+
+        for (int j = 0; j <= KMEM_MAX_ORDER; j++)
+            ListInit(&node->freeLists[j]);
+
+        // Fill in any distances not provided by the SLIT
+        for (uint32_t j = 0; j < KMemNodeCount; j++)
+        {
+            if (KMemNodeDistance[i][j] == 0)
+                KMemNodeDistance[i][j] = (i == j) ? KMEM_LOCAL_DISTANCE : KMEM_REMOTE_DISTANCE;
+        }
+
+        // Sort the other nodes by distance (nodes are only sorted once so this is fine)
+        for (uint32_t j = 0; j < KMemNodeCount; j++)
+        {
+            uint32_t k = j;
+            for (; k > 0 && KMemNodeDistance[i][node->fallback[k - 1]] > KMemNodeDistance[i][j]; k--)
+                node->fallback[k] = node->fallback[k - 1];
+
+            node->fallback[k] = j;
+        }
     }
-    AtomicUnlock(&KMemStackLock);
 }
 
-void KMemInit(uint32_t base, uint32_t length)
+void KMemAddNodeRange(uint64_t base, uint64_t end, uint32_t node)
+{
+    if (node >= KMEM_MAX_NODES)
+        Panic("Too many NUMA nodes");
+
+    if (KMemNodeRangeCount >= KMEM_MAX_NODE_RANGES)
+        Panic("Too many NUMA memory ranges");
+
+    KMemNodeRanges[KMemNodeRangeCount].base = base;
+    KMemNodeRanges[KMemNodeRangeCount].end = end;
+    KMemNodeRanges[KMemNodeRangeCount].node = node;
+    KMemNodeRangeCount++;
+
+    if (node >= KMemNodeCount)
+        KMemNodeCount = node + 1;
+}
+
+void KMemSetNodeDistance(uint32_t from, uint32_t to, uint8_t distance)
+{
+    Assert(from < KMEM_MAX_NODES && to < KMEM_MAX_NODES);
+    KMemNodeDistance[from][to] = distance;
+}
+
+void KMemInit(MultibootInfo * bootInfo)
 {
-    uint64_t rawBase = (uint64_t) KMemFromPhysical(base);
+    KMemInitNodes();
+
+    // Find all the usable memory
+    KMemRegionsFromMultiboot(bootInfo);
+
+    // Find the range of page frames the allocator must manage
+    //  Memory outside the largest possible direct map is ignored
+    uint64_t firstAddr = KMEM_DIRECT_MAP_MAX;
+    uint64_t lastAddr = 0;
+
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
+    {
+        KMemRegion * region = &KMemRegions[i];
+
+        if (region->end > KMemPhysicalEnd)
+            KMemPhysicalEnd = region->end;
+
+        if (region->type == KMEM_REGION_USABLE && region->base < KMEM_DIRECT_MAP_MAX)
+        {
+            if (region->base < firstAddr)
+                firstAddr = region->base;
+
+            if (region->end > lastAddr)
+                lastAddr = region->end;
+        }
+    }
+
+    if (KMemPhysicalEnd > KMEM_DIRECT_MAP_MAX)
+        KMemPhysicalEnd = KMEM_DIRECT_MAP_MAX;
+
+    if (lastAddr > KMEM_DIRECT_MAP_MAX)
+        lastAddr = KMEM_DIRECT_MAP_MAX;
 
-    // Require page alignment and some memory
-    Assert((base & 0xFFF) == 0);
-    Assert((length & 0xFFF) == 0);
-    Assert(length > 0);
-    
-    // Push all memory onto the stack
-    for (uint64_t i = 0x1000; i < length; i += 0x1000)
-        *((uint64_t *) (rawBase + i)) = rawBase + i - 0x1000;
-        
-    // Clear bottom page to NULL and set top page as the head of the stack
-    *((uint64_t *) rawBase) = 0;
-    KMemStackRoot = (void *) (rawBase + length - 0x1000);
+    if (firstAddr >= lastAddr)
+        Panic("No usable memory");
+
+    KMemFirstPfn = firstAddr >> 12;
+    KMemLastPfn = lastAddr >> 12;
+
+    // Find a region large enough for the page state and node tables
+    //  It must be inside the memory mapped at boot
+    uint64_t tableLength = ((KMemLastPfn - KMemFirstPfn) + 0xFFF) & ~0xFFFUL;
+    uint64_t stateLength = tableLength * 2;
+
+#ifdef CONFIG_KMEM_DEBUG
+    // The owner table goes after the other tables
+    stateLength += tableLength * sizeof(KMemOwner);
+#endif
+    uint64_t stateAddr = 0;
+
+    for (uint32_t i = 0; i < KMemRegionCount; i++)
+    {
+        KMemRegion * region = &KMemRegions[i];
+
+        if (region->type == KMEM_REGION_USABLE &&
+            region->base + stateLength <= region->end &&
+            region->base + stateLength <= KMEM_BOOT_MAP_END)
+        {
+            stateAddr = region->base;
+            break;
+        }
+    }
+
+    if (stateAddr == 0)
+        Panic("Not enough memory for the page state table");
+
+    KMemRegionReserve(stateAddr, stateAddr + stateLength);
+    KMemRegionSort();
+
+    KMemPageState = KMemFromPhysical(stateAddr);
+    memset(KMemPageState, KMEM_PAGE_USED, KMemLastPfn - KMemFirstPfn);
+
+    // Assign pages to nodes (pages not in any range are in node 0)
+    KMemPageNode = KMemFromPhysical(stateAddr + tableLength);
+    memset(KMemPageNode, 0, KMemLastPfn - KMemFirstPfn);
+
+    for (uint32_t i = 0; i < KMemNodeRangeCount; i++)
+    {
+        uint64_t first = KMemNodeRanges[i].base >> 12;
+        uint64_t last = KMemNodeRanges[i].end >> 12;
+
+        if (first < KMemFirstPfn)
+            first = KMemFirstPfn;
+        if (last > KMemLastPfn)
+            last = KMemLastPfn;
+
+        if (first < last)
+            memset(KMemPageNode + (first - KMemFirstPfn), KMemNodeRanges[i].node, last - first);
+    }
+
+#ifdef CONFIG_KMEM_DEBUG
+    KMemOwners = KMemFromPhysical(stateAddr + tableLength * 2);
+    memset(KMemOwners, 0, tableLength * sizeof(KMemOwner));
+#endif
+
+    // Free the usable memory which is already mapped
+    KMemFreeUsable(0, KMEM_BOOT_MAP_END);
+}
+
+void KMemInitHigh(void)
+{
+    KMemFreeUsable(KMEM_BOOT_MAP_END, KMEM_DIRECT_MAP_MAX);
 }
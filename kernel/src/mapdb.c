@@ -0,0 +1,422 @@
+/*
+ * kernel/src/mapdb.c
+ * Mapping database (tracks where every mapping was derived from)
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "atomic.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "slab.h"
+
+// Log2 of the page sizes
+#define MAP_LOG2_4KB        12
+#define MAP_LOG2_2MB        21
+#define MAP_LOG2_USER       47      // Log2 of MEM_USER_END
+
+// Cache of mapping nodes
+static SlabCache MapNodeCache;
+
+// Lock protecting the mapping database
+//  Page tables of mapped pages are only changed with this held
+//  Each node is stored in the page tables next to the page it maps (MemSpaceMapData)
+//  TLBs are flushed (MemBatchFinish) after it's released since that waits for other cpus
+static AtomicSpinlock MapLock;
+
+// Returns the size of the page mapped by a node
+static inline uint64_t MapNodeSize(MapNode * node)
+{
+    return 1UL << node->sizeLog2;
+}
+
+// Converts access rights into page flags
+static uint64_t MapRightsToFlags(uint32_t rights)
+{
+    uint64_t flags = MEM_PAGE_USER;
+
+    if (rights & MAP_RIGHT_W)
+        flags |= MEM_PAGE_WRITABLE;
+
+    if (!(rights & MAP_RIGHT_X))
+        flags |= MEM_PAGE_NX;
+
+    return flags;
+}
+
+// Gets the range of user memory covered by an fpage
+//  Returns false if it covers no pages
+static bool MapFpageRange(MapFpage fpage, uint64_t * base, uint32_t * sizeLog2)
+{
+    if ((fpage & ~(MapFpage) MAP_RIGHTS_ALL) == MAP_FPAGE_COMPLETE)
+    {
+        *base = 0;
+        *sizeLog2 = MAP_LOG2_USER;
+        return true;
+    }
+
+    *base = MapFpageBase(fpage);
+    *sizeLog2 = MapFpageSizeLog2(fpage);
+
+    return *sizeLog2 >= MAP_LOG2_4KB && *sizeLog2 <= MAP_LOG2_USER &&
+            *base + (1UL << *sizeLog2) <= MEM_USER_END;
+}
+
+// Adds a node to its parent's list of children
+static void MapLink(MapNode * parent, MapNode * node)
+{
+    node->parent = parent;
+    node->prevSibling = NULL;
+    node->nextSibling = NULL;
+
+    if (parent)
+    {
+        node->nextSibling = parent->firstChild;
+
+        if (parent->firstChild)
+            parent->firstChild->prevSibling = node;
+
+        parent->firstChild = node;
+    }
+}
+
+// Removes a node from its parent's list of children
+static void MapUnlink(MapNode * node)
+{
+    if (node->prevSibling)
+        node->prevSibling->nextSibling = node->nextSibling;
+    else if (node->parent)
+        node->parent->firstChild = node->nextSibling;
+
+    if (node->nextSibling)
+        node->nextSibling->prevSibling = node->prevSibling;
+}
+
+// Returns true if node is ancestor or is one of its ancestors
+static bool MapIsAncestor(MapNode * node, MapNode * ancestor)
+{
+    for (; node != NULL; node = node->parent)
+    {
+        if (node == ancestor)
+            return true;
+    }
+
+    return false;
+}
+
+// Returns the node after node in a pre-order walk of root's tree, skipping node's children
+static MapNode * MapSkip(MapNode * node, MapNode * root)
+{
+    for (; node != root; node = node->parent)
+    {
+        if (node->nextSibling)
+            return node->nextSibling;
+    }
+
+    return NULL;
+}
+
+// Unmaps and frees a node and all the mappings derived from it
+//  Nodes are removed in post-order so each node is visited once
+static void MapRemoveTree(MapNode * root, MemBatch * batch)
+{
+    MapNode * node = root;
+
+    for (;;)
+    {
+        while (node->firstChild)
+            node = node->firstChild;
+
+        MapNode * parent = node->parent;
+        bool last = (node == root);
+
+        MemSpaceUnmap(node->space, node->vAddr, MapNodeSize(node), batch);
+        MapUnlink(node);
+        SlabFree(&MapNodeCache, node);
+
+        if (last)
+            break;
+
+        node = parent;
+    }
+}
+
+// Removes the given rights from the mappings derived from root (and root itself if self is true)
+static void MapRevoke(MapNode * root, uint32_t rights, bool self, MemBatch * batch)
+{
+    MapNode * node = self ? root : root->firstChild;
+
+    while (node != NULL)
+    {
+        uint32_t newRights = node->rights & ~rights;
+
+        if (!(newRights & MAP_RIGHT_R))
+        {
+            // Pages can't be mapped without read access
+            MapNode * next = (node == root) ? NULL : MapSkip(node, root);
+
+            MapRemoveTree(node, batch);
+            node = next;
+        }
+        else
+        {
+            if (newRights != node->rights)
+            {
+                // Remapping an existing page never needs memory
+                node->rights = newRights;
+                MemSpaceMapData(node->space, node->vAddr, node->pAddr, MapNodeSize(node),
+                                MapRightsToFlags(newRights), node, batch);
+            }
+
+            node = node->firstChild ? node->firstChild : MapSkip(node, root);
+        }
+    }
+}
+
+// Removes all the mappings in a range so new mappings can be added
+//  Returns false (and stops) if keep or one of its ancestors is in the range
+static bool MapClearRange(MemSpace * space, uint64_t vAddr, uint64_t size, MapNode * keep,
+                            MemBatch * batch)
+{
+    uint64_t end = vAddr + size;
+
+    while (vAddr < end)
+    {
+        uint64_t pageSize;
+        MapNode * old = MemSpaceGetData(space, vAddr, &pageSize);
+
+        if (old)
+        {
+            // Replacing a mapping with one derived from it would create a cycle
+            if (MapIsAncestor(keep, old))
+                return false;
+
+            MapRemoveTree(old, batch);
+        }
+
+        vAddr = (vAddr & ~(pageSize - 1)) + pageSize;
+    }
+
+    return true;
+}
+
+// Creates a new mapping derived from parent
+//  Returns false if out of memory (pages past MEM_USER_MAP_END are skipped)
+static bool MapInsert(MapNode * parent, MemSpace * space, uint64_t vAddr,
+                        uint64_t pAddr, uint32_t sizeLog2, uint32_t rights, MemBatch * batch)
+{
+    if (vAddr + (1UL << sizeLog2) > MEM_USER_MAP_END)
+        return true;
+
+    if (!MapClearRange(space, vAddr, 1UL << sizeLog2, parent, batch))
+        return true;
+
+    MapNode * node = SlabAllocate(&MapNodeCache);
+    if (node == NULL)
+        return false;
+
+    node->firstChild = NULL;
+    node->space = space;
+    node->vAddr = vAddr;
+    node->pAddr = pAddr;
+    node->sizeLog2 = sizeLog2;
+    node->rights = rights;
+
+    if (!MemSpaceMapData(space, vAddr, pAddr, 1UL << sizeLog2,
+                            MapRightsToFlags(rights), node, batch))
+    {
+        MemSpaceUnmap(space, vAddr, 1UL << sizeLog2, batch);
+        SlabFree(&MapNodeCache, node);
+        return false;
+    }
+
+    MapLink(parent, node);
+    return true;
+}
+
+// Moves a mapping to another address space (keeping everything derived from it)
+//  Returns false if out of memory (pages past MEM_USER_MAP_END are skipped)
+static bool MapMove(MapNode * node, MemSpace * space, uint64_t vAddr, uint32_t rights,
+                    MemBatch * batch)
+{
+    if (node->space == space && node->vAddr == vAddr)
+        return true;
+
+    if (vAddr + MapNodeSize(node) > MEM_USER_MAP_END)
+        return true;
+
+    if (!MapClearRange(space, vAddr, MapNodeSize(node), node, batch))
+        return true;
+
+    // Derived mappings can't have more rights than this one
+    if (rights != node->rights)
+        MapRevoke(node, node->rights & ~rights, false, batch);
+
+    MemSpaceUnmap(node->space, node->vAddr, MapNodeSize(node), batch);
+
+    node->space = space;
+    node->vAddr = vAddr;
+    node->rights = rights;
+
+    if (!MemSpaceMapData(space, vAddr, node->pAddr, MapNodeSize(node),
+                            MapRightsToFlags(rights), node, batch))
+    {
+        MapRemoveTree(node, batch);
+        return false;
+    }
+
+    return true;
+}
+
+void MapInit(void)
+{
+    SlabCacheInit(&MapNodeCache, sizeof(MapNode), SLAB_CACHE_LINE, NULL);
+}
+
+bool MapRoot(MemSpace * space, uint64_t vAddr, uint64_t pAddr, uint64_t size, uint32_t rights)
+{
+    Assert(((vAddr | pAddr | size) & (MEM_PAGE_4KB - 1)) == 0);
+
+    bool result = true;
+
+    MemBatch batch;
+    MemBatchInit(&batch);
+    AtomicLock(&MapLock);
+
+    for (uint64_t offset = 0; offset < size && result; )
+    {
+        uint32_t sizeLog2 = MAP_LOG2_4KB;
+
+        if (((vAddr + offset) & (MEM_PAGE_2MB - 1)) == 0 &&
+            ((pAddr + offset) & (MEM_PAGE_2MB - 1)) == 0 &&
+            size - offset >= MEM_PAGE_2MB)
+        {
+            sizeLog2 = MAP_LOG2_2MB;
+        }
+
+        result = MapInsert(NULL, space, vAddr + offset, pAddr + offset, sizeLog2, rights, &batch);
+        offset += 1UL << sizeLog2;
+    }
+
+    AtomicUnlock(&MapLock);
+    MemBatchFinish(&batch);
+    return result;
+}
+
+bool MapFpageSend(MemSpace * from, MapFpage sendFpage, uint64_t sendBase,
+                    MemSpace * to, MapFpage recvWindow, bool grant)
+{
+    uint64_t srcStart, dstStart;
+    uint32_t sendLog2, recvLog2;
+
+    if (!MapFpageRange(sendFpage, &srcStart, &sendLog2) ||
+        !MapFpageRange(recvWindow, &dstStart, &recvLog2))
+    {
+        return true;
+    }
+
+    // Use the part of the larger fpage selected by sendBase
+    if (sendLog2 > recvLog2)
+        srcStart += sendBase & ((1UL << sendLog2) - 1) & ~((1UL << recvLog2) - 1);
+    else if (recvLog2 > sendLog2)
+        dstStart += sendBase & ((1UL << recvLog2) - 1) & ~((1UL << sendLog2) - 1);
+
+    uint64_t size = 1UL << (sendLog2 < recvLog2 ? sendLog2 : recvLog2);
+    uint32_t rights = MapFpageRights(sendFpage);
+    bool result = true;
+
+    MemBatch batch;
+    MemBatchInit(&batch);
+    AtomicLock(&MapLock);
+
+    for (uint64_t offset = 0; offset < size && result; )
+    {
+        uint64_t src = srcStart + offset;
+        uint64_t dst = dstStart + offset;
+        uint64_t pageSize;
+        MapNode * parent = MemSpaceGetData(from, src, &pageSize);
+
+        if (parent == NULL)
+        {
+            // Skip the whole unmapped region
+            offset += pageSize - (src & (pageSize - 1));
+            continue;
+        }
+
+        // Use a 2MB page if the source is one and both addresses are aligned
+        uint32_t sizeLog2 = MAP_LOG2_4KB;
+
+        if (parent->sizeLog2 == MAP_LOG2_2MB &&
+            ((src | dst) & (MEM_PAGE_2MB - 1)) == 0 &&
+            size - offset >= MEM_PAGE_2MB)
+        {
+            sizeLog2 = MAP_LOG2_2MB;
+        }
+
+        uint32_t newRights = parent->rights & rights;
+
+        if (newRights & MAP_RIGHT_R)
+        {
+            if (grant && sizeLog2 == parent->sizeLog2)
+            {
+                result = MapMove(parent, to, dst, newRights, &batch);
+            }
+            else
+            {
+                // Parts of large pages are always mapped (even when granting)
+                uint64_t pAddr = parent->pAddr + (src & (MapNodeSize(parent) - 1));
+                result = MapInsert(parent, to, dst, pAddr, sizeLog2, newRights, &batch);
+            }
+        }
+
+        offset += 1UL << sizeLog2;
+    }
+
+    AtomicUnlock(&MapLock);
+    MemBatchFinish(&batch);
+    return result;
+}
+
+void MapUnmap(MemSpace * space, MapFpage fpage, bool flush)
+{
+    uint64_t vAddr;
+    uint32_t sizeLog2;
+    uint32_t rights = MapFpageRights(fpage);
+
+    if (rights == 0 || !MapFpageRange(fpage, &vAddr, &sizeLog2))
+        return;
+
+    uint64_t end = vAddr + (1UL << sizeLog2);
+
+    MemBatch batch;
+    MemBatchInit(&batch);
+    AtomicLock(&MapLock);
+
+    while (vAddr < end)
+    {
+        uint64_t pageSize;
+        MapNode * node = MemSpaceGetData(space, vAddr, &pageSize);
+
+        if (node)
+            MapRevoke(node, rights, flush, &batch);
+
+        vAddr = (vAddr & ~(pageSize - 1)) + pageSize;
+    }
+
+    AtomicUnlock(&MapLock);
+    MemBatchFinish(&batch);
+}
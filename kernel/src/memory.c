@@ -19,14 +19,997 @@
  */
 
 #include "global.h"
+#include "atomic.h"
+#include "cpu.h"
+#include "intr.h"
+#include "kmemory.h"
+#include "memory.h"
 
 // Kernel only paging tables
 //  Initialized in start.s
 //  0000 - 0FFF = PML4 Table
 //  1000 - 1FFF = PDPT (512 GB mapped pages)
 //  2000 - 5FFF = 4 PDT Tables (covering first 4GB of physical memory)
+//  The rest of the direct map is created by MemInitDirectMap
 uint8_t MemKernelTables[0x6000] ALIGN(4096);
 
+// The kernel PDPT (entries 0 - 509 are the direct map, 510 is the kernel image)
+#define MEM_KERNEL_PDPT     ((uint64_t *) (MemKernelTables + 0x1000))
+
+// Number of 1GB entries in the kernel PDPT used by the direct map
+static uint32_t MemDirectMapGBs = 4;
+
+// Flags used for entries pointing to other page tables
+//  The real permissions are set in the lowest level entry
+#define MEM_TABLE_FLAGS     (MEM_PAGE_PRESENT | MEM_PAGE_WRITABLE | MEM_PAGE_USER)
+
+// Address bits of a 2MB page entry
+#define MEM_LARGE_ADDR_MASK 0x000FFFFFFFE00000
+
+// Largest number of pages flushed individually (the whole TLB is flushed above this)
+#define MEM_FLUSH_MAX_PAGES 32
+
+// CR3 bit which keeps the TLB entries of the new PCID
+#define MEM_CR3_NOFLUSH     0x8000000000000000
+
+// CR4 bit enabling PCIDs
+#define MEM_CR4_PCIDE       0x20000
+
+// INVPCID types
+#define MEM_INVPCID_ADDR    0
+
+// Page table levels (PT = 0, PD = 1, PDPT = 2, PML4 = 3)
+//  PTs and PDs are followed by a page of data pointers (one for each entry)
+#define MEM_LEVEL_PD        1
+#define MEM_LEVEL_PML4      3
+
+// True if PCIDs and the INVPCID instruction are used
+static bool MemPcidEnabled;
+static bool MemInvpcidEnabled;
+
+// Last address space id used
+static uint64_t MemLastSpaceId;
+
+// Number of batches with changes which haven't been flushed yet
+static uint32_t MemBatchesActive;
+
+// State passed down a page table walk
+typedef struct MemWalk
+{
+    uint64_t pAddr;         // Physical address to map to the current virtual address
+    uint64_t flags;         // Flags of the new entries
+    void * data;            // Data pointer stored with the new entries
+    bool flush;             // True if an existing mapping was changed
+    MemBatch * batch;       // Batch holding the page tables to free once the TLBs are flushed
+
+} MemWalk;
+
+// Returns the number of address bits covered by an entry at the given level
+static inline uint32_t MemLevelShift(int level)
+{
+    return 12 + 9 * level;
+}
+
+// Returns the table an entry points to
+static inline uint64_t * MemEntryTable(uint64_t entry)
+{
+    return KMemFromPhysical(entry & MEM_PAGE_ADDR_MASK);
+}
+
+// Returns the data pointers of a PT or PD
+static inline void ** MemTableData(uint64_t * table)
+{
+    return (void **) (table + 512);
+}
+
+#ifndef CONFIG_HOSTBENCH
+
+// Returns the physical address of the current cpu's PML4
+static inline uint64_t MemGetCr3(void)
+{
+    uint64_t cr3;
+    __asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void MemSetCr3(uint64_t cr3)
+{
+    __asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+// Flushes one page of the active address space
+static inline void MemInvlpg(uint64_t vAddr)
+{
+    __asm volatile("invlpg (%0)" :: "r"(vAddr) : "memory");
+}
+
+// Flushes one page of an address space which may not be active
+static inline void MemInvpcid(uint64_t pcid, uint64_t vAddr)
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t addr;
+
+    } desc = { pcid, vAddr };
+
+    __asm volatile("invpcid %0, %1" :: "m"(desc), "r"((uint64_t) MEM_INVPCID_ADDR) : "memory");
+}
+
+// Sets the PCID enable bit in cr4
+static inline void MemEnablePcid(void)
+{
+    uint64_t cr4;
+    __asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm volatile("mov %0, %%cr4" :: "r"(cr4 | MEM_CR4_PCIDE));
+}
+
+#else
+
+// The host benchmarks emulate cr3 and have no TLB to flush
+extern uint64_t HostCr3;
+void HostCr3Load(uint64_t cr3);
+
+static inline uint64_t MemGetCr3(void)
+{
+    return HostCr3;
+}
+
+static inline void MemSetCr3(uint64_t cr3)
+{
+    HostCr3Load(cr3);
+}
+
+static inline void MemInvlpg(UNUSED uint64_t vAddr)
+{
+}
+
+static inline void MemInvpcid(UNUSED uint64_t pcid, UNUSED uint64_t vAddr)
+{
+}
+
+static inline void MemEnablePcid(void)
+{
+}
+
+#endif
+
+// Returns the PCID the current cpu uses for an address space (or 0 if it has none)
+static uint32_t MemFindPcid(MemCpuState * state, MemSpace * space)
+{
+    for (uint32_t i = 1; i < MEM_PCID_COUNT; i++)
+    {
+        if (state->pcidSpace[i] == space->id)
+            return i;
+    }
+
+    return 0;
+}
+
+// Flushes a range of an address space from this cpu's TLB
+//  gen is the tlbGen of the space after the change (or 0 if unknown)
+static void MemFlushLocal(MemCpuState * state, MemSpace * space, uint64_t vAddr, uint64_t end, uint64_t gen)
+{
+    bool active = (MemGetCr3() & MEM_PAGE_ADDR_MASK) == KMemToPhysical(space->pml4);
+    bool small = end - vAddr <= MEM_FLUSH_MAX_PAGES * MEM_PAGE_4KB;
+    uint32_t pcid = MemPcidEnabled ? MemFindPcid(state, space) : 0;
+
+    if (active)
+    {
+        if (small)
+        {
+            for (; vAddr < end; vAddr += MEM_PAGE_4KB)
+                MemInvlpg(vAddr);
+        }
+        else
+        {
+            // Reloading cr3 flushes all non-global pages (of the current PCID)
+            MemSetCr3(MemGetCr3());
+        }
+    }
+    else if (pcid != 0 && MemInvpcidEnabled && small)
+    {
+        // Flush the inactive PCID now instead of all of it at the next switch
+        for (; vAddr < end; vAddr += MEM_PAGE_4KB)
+            MemInvpcid(pcid, vAddr);
+    }
+    else
+    {
+        // Inactive PCIDs are flushed at the next switch since tlbGen has changed
+        return;
+    }
+
+    // This cpu's entries are valid again if they were valid before this change
+    if (pcid != 0 && gen != 0 && state->pcidGen[pcid] == gen - 1)
+        state->pcidGen[pcid] = gen;
+}
+
+// Flushes all non-global entries from this cpu's TLB
+static void MemFlushAll(MemCpuState * state)
+{
+    uint64_t cr3 = MemGetCr3();
+
+    MemSetCr3(cr3);
+
+    // Other PCIDs are forgotten so they're flushed when they're next used
+    for (uint32_t i = 1; i < MEM_PCID_COUNT; i++)
+    {
+        if (i != (cr3 & 0xFFF))
+            state->pcidSpace[i] = 0;
+    }
+}
+
+// Adds a flush to another cpu's shootdown queue
+//  Queued ranges of the same address space are merged
+static void MemShootdownQueue(MemCpuState * target, MemSpace * space, uint64_t start, uint64_t end, uint64_t gen)
+{
+    AtomicLock(&target->shootLock);
+    {
+        if (!target->shootOverflow)
+        {
+            uint32_t i = 0;
+            while (i < target->shootCount && target->shootQueue[i].space != space)
+                i++;
+
+            if (i < target->shootCount)
+            {
+                MemShootdown * queued = &target->shootQueue[i];
+
+                if (start < queued->start)
+                    queued->start = start;
+                if (end > queued->end)
+                    queued->end = end;
+
+                queued->gen = 0;
+            }
+            else if (i < MEM_SHOOTDOWN_QUEUE)
+            {
+                target->shootQueue[i].space = space;
+                target->shootQueue[i].start = start;
+                target->shootQueue[i].end = end;
+                target->shootQueue[i].gen = gen;
+                target->shootCount++;
+            }
+            else
+            {
+                target->shootOverflow = true;
+            }
+        }
+
+        target->shootQueued++;
+    }
+    AtomicUnlock(&target->shootLock);
+}
+
+void MemShootdownHandler(void)
+{
+    MemCpuState * state = &CpuCurrent()->mem;
+    MemShootdown queue[MEM_SHOOTDOWN_QUEUE];
+    uint32_t count;
+    bool overflow;
+    uint64_t queued;
+
+    // Racy check for an empty queue (any new requests send another IPI)
+    if (state->shootDone == state->shootQueued)
+        return;
+
+    // Take all the queued requests
+    AtomicLock(&state->shootLock);
+    {
+        count = state->shootCount;
+        overflow = state->shootOverflow;
+        queued = state->shootQueued;
+
+        memcpy(queue, state->shootQueue, count * sizeof(MemShootdown));
+        state->shootCount = 0;
+        state->shootOverflow = false;
+    }
+    AtomicUnlock(&state->shootLock);
+
+    if (overflow)
+    {
+        MemFlushAll(state);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < count; i++)
+            MemFlushLocal(state, queue[i].space, queue[i].start, queue[i].end, queue[i].gen);
+    }
+
+    // Tell the waiting cpus the flushes are done
+    AtomicBarrier();
+    state->shootDone = queued;
+}
+
+// Asks another cpu to flush its whole TLB
+static void MemShootdownQueueAll(MemCpuState * target)
+{
+    AtomicLock(&target->shootLock);
+    target->shootOverflow = true;
+    target->shootQueued++;
+    AtomicUnlock(&target->shootLock);
+}
+
+// Flushes the ranges in a batch from the TLBs of all the cpus using their address spaces
+//  Each target gets one IPI however many ranges it has to flush
+//  Must be called without holding any locks (other cpus may need to take them before they can respond)
+static void MemShootdownBatch(MemBatch * batch)
+{
+    Cpu * self = CpuCurrent();
+    uint64_t mask[MEM_CPU_MASK_WORDS];
+    uint32_t targets = 0;
+
+    for (uint32_t i = 0; i < MEM_CPU_MASK_WORDS; i++)
+        mask[i] = 0;
+
+    if (batch->flushAll)
+    {
+        // Every cpu might be using one of the spaces
+        MemFlushAll(&self->mem);
+
+        for (uint32_t i = 0; i < CpuCount; i++)
+        {
+            if (i != self->id)
+            {
+                MemShootdownQueueAll(&CpuList[i]->mem);
+                mask[i / 64] |= 1UL << (i % 64);
+                targets++;
+            }
+        }
+    }
+    else
+    {
+        for (uint32_t r = 0; r < batch->count; r++)
+        {
+            MemShootdown * range = &batch->ranges[r];
+            MemSpace * space = range->space;
+
+            // Invalidate the space's PCIDs on every cpu
+            //  This is also a barrier so any cpu which starts using the space after the
+            //  mask is read below will see the new generation and flush its PCID
+            uint64_t gen = AtomicAdd(&space->tlbGen, 1);
+
+            MemFlushLocal(&self->mem, space, range->start, range->end, gen);
+
+            // Queue the flush on the other cpus using the space
+            for (uint32_t i = 0; i < CpuCount; i++)
+            {
+                if (i != self->id && (space->cpuMask[i / 64] & (1UL << (i % 64))))
+                {
+                    MemShootdownQueue(&CpuList[i]->mem, space, range->start, range->end, gen);
+
+                    if (!(mask[i / 64] & (1UL << (i % 64))))
+                    {
+                        mask[i / 64] |= 1UL << (i % 64);
+                        targets++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (targets == 0)
+        return;
+
+    // Use one broadcast IPI if most cpus need it
+    //  Cpus with nothing queued ignore it
+    if (targets > (CpuCount - 1) / 2)
+    {
+        CpuSendIpiOthers(INTR_APIC_SHOOTDOWN);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < CpuCount; i++)
+        {
+            if (mask[i / 64] & (1UL << (i % 64)))
+                CpuSendIpi(CpuList[i], INTR_APIC_SHOOTDOWN);
+        }
+    }
+
+    // Wait for each target to empty its queue up to (at least) our request
+    //  Interrupts are disabled so our own queue is handled while waiting in case
+    //  another cpu is waiting for us
+    for (uint32_t i = 0; i < CpuCount; i++)
+    {
+        if (mask[i / 64] & (1UL << (i % 64)))
+        {
+            MemCpuState * target = &CpuList[i]->mem;
+            uint64_t wait = *((volatile uint64_t *) &target->shootQueued);
+
+            while (target->shootDone < wait)
+            {
+                MemShootdownHandler();
+                AtomicPause();
+            }
+        }
+    }
+}
+
+// Frees a list of page tables created by MemFreeTable
+static void MemFreeTableList(void * list, uint32_t order)
+{
+    while (list != NULL)
+    {
+        void * next = *((void **) list);
+
+        KMemFreeOrder(list, order);
+        list = next;
+    }
+}
+
+// Allocates an empty page table for the given level
+static uint64_t * MemAllocTable(int level)
+{
+    if (level > MEM_LEVEL_PD)
+        return KMemZAllocate();
+
+    // Tables with data pointers are 2 pages long
+    uint64_t * table = KMemAllocateOrder(1);
+
+    if (table != NULL)
+        memset(table, 0, 2 * MEM_PAGE_4KB);
+
+    return table;
+}
+
+// Frees a page table and all the tables below it
+//  If walk is not NULL, the tables are added to its batch instead of being freed
+//  (the list link reads as a non-present entry to any cpu still using the table)
+//  If walk is NULL, 4KB pages mapped without a data pointer are freed as well
+static void MemFreeTable(uint64_t * table, int level, MemWalk * walk)
+{
+    if (level > 0)
+    {
+        for (int i = 0; i < 512; i++)
+        {
+            if ((table[i] & MEM_PAGE_PRESENT) && !(table[i] & MEM_PAGE_LARGE))
+                MemFreeTable(MemEntryTable(table[i]), level - 1, walk);
+        }
+    }
+    else if (walk == NULL)
+    {
+        void ** data = MemTableData(table);
+
+        for (int i = 0; i < 512; i++)
+        {
+            if ((table[i] & MEM_PAGE_PRESENT) && data[i] == NULL)
+                KMemFree(MemEntryTable(table[i]));
+        }
+    }
+
+    if (walk == NULL)
+    {
+        KMemFreeOrder(table, level > MEM_LEVEL_PD ? 0 : 1);
+    }
+    else if (level > MEM_LEVEL_PD)
+    {
+        *((void **) table) = walk->batch->freeTables;
+        walk->batch->freeTables = table;
+    }
+    else
+    {
+        *((void **) table) = walk->batch->freeDataTables;
+        walk->batch->freeDataTables = table;
+    }
+}
+
+// Returns the table entry i of a table points to, creating it if needed
+//  2MB pages are split into tables of 4KB pages
+//  Returns NULL if out of memory
+static uint64_t * MemGetTable(uint64_t * table, uint32_t i, int level, MemWalk * walk)
+{
+    uint64_t entry = table[i];
+
+    if ((entry & MEM_PAGE_PRESENT) && !(entry & MEM_PAGE_LARGE))
+        return MemEntryTable(entry);
+
+    uint64_t * next = MemAllocTable(level - 1);
+    if (next == NULL)
+        return NULL;
+
+    if (entry & MEM_PAGE_PRESENT)
+    {
+        // Split the 2MB page (bit 12 is the large page PAT bit which is never used)
+        uint64_t base = entry & MEM_LARGE_ADDR_MASK;
+        uint64_t flags = entry & ~(MEM_LARGE_ADDR_MASK | MEM_PAGE_LARGE | 0x1000);
+        void * data = MemTableData(table)[i];
+
+        for (uint64_t j = 0; j < 512; j++)
+        {
+            next[j] = (base + (j << 12)) | flags;
+            MemTableData(next)[j] = data;
+        }
+
+        MemTableData(table)[i] = NULL;
+
+        // Page size changes must always be flushed
+        walk->flush = true;
+    }
+
+    table[i] = KMemToPhysical(next) | MEM_TABLE_FLAGS;
+    return next;
+}
+
+// Maps the range [vAddr, end) which must be inside the given table
+static bool MemMapTable(uint64_t * table, int level, uint64_t vAddr, uint64_t end, MemWalk * walk)
+{
+    uint64_t size = 1UL << MemLevelShift(level);
+
+    for (uint32_t i = (vAddr >> MemLevelShift(level)) & 511; vAddr < end; i++)
+    {
+        // End of the part of the range covered by this entry
+        uint64_t entryEnd = (vAddr & ~(size - 1)) + size;
+        if (entryEnd > end)
+            entryEnd = end;
+
+        uint64_t entry = table[i];
+
+        if (level == 0)
+        {
+            if (entry & MEM_PAGE_PRESENT)
+                walk->flush = true;
+
+            table[i] = walk->pAddr | walk->flags;
+            MemTableData(table)[i] = walk->data;
+            walk->pAddr += MEM_PAGE_4KB;
+        }
+        else if (level == MEM_LEVEL_PD && entryEnd - vAddr == size &&
+                (walk->pAddr & (size - 1)) == 0)
+        {
+            // Map the whole entry with a 2MB page
+            if (entry & MEM_PAGE_PRESENT)
+            {
+                if (!(entry & MEM_PAGE_LARGE))
+                    MemFreeTable(MemEntryTable(entry), level - 1, walk);
+
+                walk->flush = true;
+            }
+
+            table[i] = walk->pAddr | walk->flags | MEM_PAGE_LARGE;
+            MemTableData(table)[i] = walk->data;
+            walk->pAddr += size;
+        }
+        else
+        {
+            // Map part of the entry using the next level (which advances pAddr)
+            uint64_t * next = MemGetTable(table, i, level, walk);
+
+            if (next == NULL || !MemMapTable(next, level - 1, vAddr, entryEnd, walk))
+                return false;
+        }
+
+        vAddr = entryEnd;
+    }
+
+    return true;
+}
+
+// Clears an entry and its data pointer
+static inline void MemClearEntry(uint64_t * table, uint32_t i, int level)
+{
+    table[i] = 0;
+
+    if (level <= MEM_LEVEL_PD)
+        MemTableData(table)[i] = NULL;
+}
+
+// Unmaps the range [vAddr, end) which must be inside the given table
+static void MemUnmapTable(uint64_t * table, int level, uint64_t vAddr, uint64_t end, MemWalk * walk)
+{
+    uint64_t size = 1UL << MemLevelShift(level);
+
+    for (uint32_t i = (vAddr >> MemLevelShift(level)) & 511; vAddr < end; i++)
+    {
+        uint64_t entryEnd = (vAddr & ~(size - 1)) + size;
+        if (entryEnd > end)
+            entryEnd = end;
+
+        uint64_t entry = table[i];
+
+        if (entry & MEM_PAGE_PRESENT)
+        {
+            if (level == 0 || entryEnd - vAddr == size)
+            {
+                // The whole entry is unmapped
+                if (level > 0 && !(entry & MEM_PAGE_LARGE))
+                    MemFreeTable(MemEntryTable(entry), level - 1, walk);
+
+                MemClearEntry(table, i, level);
+                walk->flush = true;
+            }
+            else
+            {
+                uint64_t * next = MemGetTable(table, i, level, walk);
+
+                if (next != NULL)
+                {
+                    MemUnmapTable(next, level - 1, vAddr, entryEnd, walk);
+                }
+                else
+                {
+                    // Can't split the 2MB page so unmap all of it
+                    MemClearEntry(table, i, level);
+                    walk->flush = true;
+                }
+            }
+        }
+
+        vAddr = entryEnd;
+    }
+}
+
+bool MemSpaceInit(MemSpace * space)
+{
+    space->pml4 = KMemZAllocate();
+    if (space->pml4 == NULL)
+        return false;
+
+    // Share the kernel half (the kernel never adds PML4 entries after boot)
+    memcpy(space->pml4 + 256, MemKernelTables + 0x800, 256 * sizeof(uint64_t));
+
+    AtomicLockInit(&space->lock);
+    space->id = AtomicAdd(&MemLastSpaceId, 1);
+    space->tlbGen = 0;
+
+    for (int i = 0; i < MEM_CPU_MASK_WORDS; i++)
+        space->cpuMask[i] = 0;
+
+    return true;
+}
+
+void MemSpaceDestroy(MemSpace * space)
+{
+    for (int i = 0; i < MEM_CPU_MASK_WORDS; i++)
+        Assert(space->cpuMask[i] == 0);
+
+    // Batches started before the space was unmapped may still flush it
+    //  Shootdowns are handled while waiting since those batches may be waiting for us
+    while (*((volatile uint32_t *) &MemBatchesActive) != 0)
+    {
+        MemShootdownHandler();
+        AtomicPause();
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        if (space->pml4[i] & MEM_PAGE_PRESENT)
+            MemFreeTable(MemEntryTable(space->pml4[i]), MEM_LEVEL_PML4 - 1, NULL);
+    }
+
+    KMemFree(space->pml4);
+    space->pml4 = NULL;
+}
+
+// Adds a changed range to a batch
+//  Ranges in the same address space are merged
+static void MemBatchAdd(MemBatch * batch, MemSpace * space, uint64_t start, uint64_t end)
+{
+    uint32_t i = 0;
+
+    if (batch->flushAll)
+        return;
+
+    // Counted before the caller releases the lock protecting the space
+    if (batch->count == 0)
+        AtomicAdd(&MemBatchesActive, 1);
+
+    while (i < batch->count && batch->ranges[i].space != space)
+        i++;
+
+    if (i < batch->count)
+    {
+        if (start < batch->ranges[i].start)
+            batch->ranges[i].start = start;
+        if (end > batch->ranges[i].end)
+            batch->ranges[i].end = end;
+    }
+    else if (i < MEM_BATCH_SPACES)
+    {
+        batch->ranges[i].space = space;
+        batch->ranges[i].start = start;
+        batch->ranges[i].end = end;
+        batch->count++;
+    }
+    else
+    {
+        batch->flushAll = true;
+    }
+}
+
+void MemBatchInit(MemBatch * batch)
+{
+    batch->count = 0;
+    batch->flushAll = false;
+    batch->freeTables = NULL;
+    batch->freeDataTables = NULL;
+}
+
+void MemBatchFinish(MemBatch * batch)
+{
+    // Flush everything at once and then free the old tables
+    if (batch->count > 0 || batch->flushAll)
+    {
+        MemShootdownBatch(batch);
+        AtomicAdd(&MemBatchesActive, -1);
+    }
+
+    MemFreeTableList(batch->freeTables, 0);
+    MemFreeTableList(batch->freeDataTables, 1);
+    MemBatchInit(batch);
+}
+
+bool MemSpaceMap(MemSpace * space, uint64_t vAddr, uint64_t pAddr, uint64_t size, uint64_t flags)
+{
+    return MemSpaceMapData(space, vAddr, pAddr, size, flags, NULL, NULL);
+}
+
+bool MemSpaceMapData(MemSpace * space, uint64_t vAddr, uint64_t pAddr,
+                        uint64_t size, uint64_t flags, void * data, MemBatch * batch)
+{
+    Assert(((vAddr | pAddr | size) & (MEM_PAGE_4KB - 1)) == 0);
+    Assert(vAddr + size >= vAddr && vAddr + size <= MEM_USER_END);
+
+    MemBatch ownBatch;
+    MemWalk walk;
+    bool result;
+
+    if (batch == NULL)
+    {
+        MemBatchInit(&ownBatch);
+        batch = &ownBatch;
+    }
+
+    walk.pAddr = pAddr;
+    walk.flags = (flags & ~(MEM_PAGE_ADDR_MASK | MEM_PAGE_LARGE)) | MEM_PAGE_PRESENT;
+    walk.data = data;
+    walk.flush = false;
+    walk.batch = batch;
+
+    AtomicLock(&space->lock);
+    result = MemMapTable(space->pml4, MEM_LEVEL_PML4, vAddr, vAddr + size, &walk);
+    AtomicUnlock(&space->lock);
+
+    if (walk.flush)
+        MemBatchAdd(batch, space, vAddr, vAddr + size);
+
+    if (batch == &ownBatch)
+        MemBatchFinish(batch);
+
+    return result;
+}
+
+void MemSpaceUnmap(MemSpace * space, uint64_t vAddr, uint64_t size, MemBatch * batch)
+{
+    Assert(((vAddr | size) & (MEM_PAGE_4KB - 1)) == 0);
+    Assert(vAddr + size >= vAddr && vAddr + size <= MEM_USER_END);
+
+    MemBatch ownBatch;
+    MemWalk walk;
+
+    if (batch == NULL)
+    {
+        MemBatchInit(&ownBatch);
+        batch = &ownBatch;
+    }
+
+    walk.flush = false;
+    walk.batch = batch;
+
+    AtomicLock(&space->lock);
+    MemUnmapTable(space->pml4, MEM_LEVEL_PML4, vAddr, vAddr + size, &walk);
+    AtomicUnlock(&space->lock);
+
+    if (walk.flush)
+        MemBatchAdd(batch, space, vAddr, vAddr + size);
+
+    if (batch == &ownBatch)
+        MemBatchFinish(batch);
+}
+
+bool MemSpaceLookup(MemSpace * space, uint64_t vAddr, uint64_t * pAddr, uint64_t * flags)
+{
+    if (vAddr >= MEM_USER_END)
+        return false;
+
+    uint64_t * table = space->pml4;
+
+    for (int level = MEM_LEVEL_PML4; level >= 0; level--)
+    {
+        uint64_t entry = table[(vAddr >> MemLevelShift(level)) & 511];
+
+        if (!(entry & MEM_PAGE_PRESENT))
+            return false;
+
+        if (level == 0 || (entry & MEM_PAGE_LARGE))
+        {
+            uint64_t mask = (1UL << MemLevelShift(level)) - 1;
+            uint64_t addrMask = (level == 0) ? MEM_PAGE_ADDR_MASK : MEM_LARGE_ADDR_MASK;
+
+            *pAddr = (entry & addrMask) | (vAddr & mask);
+            *flags = entry & ~addrMask;
+            return true;
+        }
+
+        table = MemEntryTable(entry);
+    }
+
+    return false;
+}
+
+void MemSpaceLockPair(MemSpace * a, MemSpace * b)
+{
+    // Always lock in address order so two cpus locking the same pair can't deadlock
+    if (a > b)
+    {
+        MemSpace * tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    AtomicLock(&a->lock);
+
+    if (b != a)
+        AtomicLock(&b->lock);
+}
+
+void MemSpaceUnlockPair(MemSpace * a, MemSpace * b)
+{
+    if (b != a)
+        AtomicUnlock(&b->lock);
+
+    AtomicUnlock(&a->lock);
+}
+
+void * MemSpaceGetData(MemSpace * space, uint64_t vAddr, uint64_t * size)
+{
+    Assert(vAddr < MEM_USER_END);
+
+    uint64_t * table = space->pml4;
+    void * data = NULL;
+
+    AtomicLock(&space->lock);
+
+    for (int level = MEM_LEVEL_PML4; level >= 0; level--)
+    {
+        uint32_t i = (vAddr >> MemLevelShift(level)) & 511;
+        uint64_t entry = table[i];
+
+        // Return the size of the page or of the unmapped region
+        if (level == 0 || !(entry & MEM_PAGE_PRESENT) || (entry & MEM_PAGE_LARGE))
+        {
+            if ((entry & MEM_PAGE_PRESENT) && level <= MEM_LEVEL_PD)
+                data = MemTableData(table)[i];
+
+            *size = 1UL << MemLevelShift(level);
+            break;
+        }
+
+        table = MemEntryTable(entry);
+    }
+
+    AtomicUnlock(&space->lock);
+    return data;
+}
+
+void MemSpaceSwitch(MemSpace * space)
+{
+    Cpu * cpu = CpuCurrent();
+    MemCpuState * state = &cpu->mem;
+    uint64_t cr3 = KMemToPhysical(space->pml4);
+
+    // Move this cpu to the new space's cpu mask
+    //  This is done before reading tlbGen so any concurrent change to the space
+    //  either sends this cpu a shootdown or causes a flush below
+    if (state->current != space)
+    {
+        uint64_t bit = 1UL << (cpu->id % 64);
+
+        if (state->current)
+            AtomicAnd(&state->current->cpuMask[cpu->id / 64], ~bit);
+
+        AtomicOr(&space->cpuMask[cpu->id / 64], bit);
+        state->current = space;
+    }
+
+    if (!MemPcidEnabled)
+    {
+        if (MemGetCr3() != cr3)
+            MemSetCr3(cr3);
+
+        return;
+    }
+
+    uint32_t pcid = MemFindPcid(state, space);
+
+    if (MemGetCr3() == (cr3 | pcid))
+        return;
+
+    // Read the generation before switching so changes made during the switch cause a flush later
+    uint64_t gen = space->tlbGen;
+
+    if (pcid == 0)
+    {
+        // Recycle the oldest PCID (loading it without NOFLUSH clears its old entries)
+        pcid = state->pcidNext;
+        state->pcidNext = (pcid % (MEM_PCID_COUNT - 1)) + 1;
+        state->pcidSpace[pcid] = space->id;
+    }
+    else if (state->pcidGen[pcid] == gen)
+    {
+        // The TLB entries of this PCID are still valid
+        cr3 |= MEM_CR3_NOFLUSH;
+    }
+
+    state->pcidGen[pcid] = gen;
+    MemSetCr3(cr3 | pcid);
+}
+
+void MemInitCpu(MemCpuState * state)
+{
+    uint32_t regs[4];
+
+    memset(state, 0, sizeof(MemCpuState));
+    state->pcidNext = 1;
+
+    // Check for PCID (CPUID 1 ECX bit 17) and INVPCID (CPUID 7 EBX bit 10)
+    //  Every cpu is assumed to have the same features as the boot cpu
+    CpuId(1, 0, regs);
+    if (!(regs[2] & (1 << 17)))
+        return;
+
+    CpuId(0, 0, regs);
+    if (regs[0] >= 7)
+    {
+        CpuId(7, 0, regs);
+        MemInvpcidEnabled = regs[1] & (1 << 10);
+    }
+
+    // Enable PCIDs (the current PCID is 0)
+    MemEnablePcid();
+    MemPcidEnabled = true;
+}
+
+void MemInitDirectMap(uint64_t end)
+{
+    Assert(end <= KMEM_DIRECT_MAP_MAX);
+
+    // Check for 1GB page support (CPUID 80000001h EDX bit 26)
+    uint32_t regs[4];
+    CpuId(0x80000001, 0, regs);
+    bool hugePages = regs[3] & (1 << 26);
+
+    uint32_t endGBs = (end + 0x3FFFFFFF) >> 30;
+
+    for (; MemDirectMapGBs < endGBs; MemDirectMapGBs++)
+    {
+        uint64_t base = (uint64_t) MemDirectMapGBs << 30;
+
+        if (hugePages)
+        {
+            // Map the whole GB with one entry
+            MEM_KERNEL_PDPT[MemDirectMapGBs] = base |
+                MEM_PAGE_PRESENT | MEM_PAGE_WRITABLE | MEM_PAGE_LARGE;
+        }
+        else
+        {
+            // Create a PDT of 2MB pages
+            //  Memory below 4GB is always mapped so this allocation is safe
+            uint64_t * pdt = KMemAllocate();
+            if (pdt == NULL)
+                Panic("Out of memory creating the direct map");
+
+            for (uint64_t i = 0; i < 512; i++)
+            {
+                pdt[i] = (base + (i << 21)) |
+                    MEM_PAGE_PRESENT | MEM_PAGE_WRITABLE | MEM_PAGE_LARGE;
+            }
+
+            MEM_KERNEL_PDPT[MemDirectMapGBs] = KMemToPhysical(pdt) |
+                MEM_PAGE_PRESENT | MEM_PAGE_WRITABLE;
+        }
+    }
+}
+
 void MemEnableGlobalPages(void)
 {
     // Unmap lower identity mapped region
@@ -39,4 +1022,20 @@ void MemEnableGlobalPages(void)
     // Enable global bit in all PDT entries
     for (int i = 0x2001; i < 0x6000; i += 8)
         MemKernelTables[i] |= 1;        // Global flag
+
+    // Enable global bit in the rest of the direct map
+    for (uint32_t i = 4; i < MemDirectMapGBs; i++)
+    {
+        if (MEM_KERNEL_PDPT[i] & MEM_PAGE_LARGE)
+        {
+            MEM_KERNEL_PDPT[i] |= MEM_PAGE_GLOBAL;
+        }
+        else
+        {
+            uint64_t * pdt = KMemFromPhysical(MEM_KERNEL_PDPT[i] & MEM_PAGE_ADDR_MASK);
+
+            for (int j = 0; j < 512; j++)
+                pdt[j] |= MEM_PAGE_GLOBAL;
+        }
+    }
 }
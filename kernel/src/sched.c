@@ -0,0 +1,527 @@
+/*
+ * kernel/src/sched.c
+ * Thread scheduler
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "cpu.h"
+#include "intr.h"
+#include "ipc.h"
+#include "kmemory.h"
+#include "list.h"
+#include "sched.h"
+#include "thread.h"
+#include "time.h"
+
+// Counts a run queue insertion or deletion (only the host benchmarks count them)
+#ifdef CONFIG_HOSTBENCH
+extern uint64_t HostQueueOps;
+# define SCHED_COUNT_OP()   (HostQueueOps++)
+#else
+# define SCHED_COUNT_OP()   ((void) 0)
+#endif
+
+// Returns the highest priority with a runnable thread (or -1 if there are none)
+static inline int SchedHighest(SchedCpuState * sched)
+{
+    if (sched->summary == 0)
+        return -1;
+
+    uint32_t word = 63 - CLZ(sched->summary);
+    return word * 64 + 63 - CLZ(sched->bitmap[word]);
+}
+
+// Returns true if a thread is in a run queue
+static inline bool SchedIsQueued(Thread * thread)
+{
+    return thread->runNode.next != NULL;
+}
+
+// Starts a new timeslice for a thread about to run on this cpu
+//  The timer is only needed if other threads are waiting to run
+static void SchedStartSlice(Cpu * cpu, Thread * thread)
+{
+    SchedCpuState * sched = &cpu->sched;
+    uint32_t waiting = sched->load - (SchedIsQueued(thread) ? 1 : 0);
+
+    sched->sliceOver = false;
+
+    if (thread == cpu->idleThread || waiting == 0)
+        TimeEventCancel(&sched->sliceEvent);
+    else
+        TimeEventAdd(&sched->sliceEvent, TimeNow() + SCHED_TIMESLICE);
+}
+
+// Marks the current timeslice as over (SchedTimer does the switch)
+static void SchedSliceEnd(TimeEvent * event)
+{
+    ListGet(event, SchedCpuState, sliceEvent)->sliceOver = true;
+}
+
+// Adds a thread to the start or end of its queue
+static void SchedInsert(SchedCpuState * sched, Thread * thread, bool front)
+{
+    uint32_t priority = thread->priority;
+    List * queue = &sched->queues[priority];
+
+    Assert(thread->cpu == CpuCurrent());
+
+    if (ListIsEmpty(queue))
+    {
+        sched->bitmap[priority / 64] |= 1UL << (priority % 64);
+        sched->summary |= 1UL << (priority / 64);
+    }
+
+    SCHED_COUNT_OP();
+
+    if (front)
+        ListAddFirst(queue, &thread->runNode);
+    else
+        ListAddLast(queue, &thread->runNode);
+
+    sched->load++;
+
+    // The current thread now has to share the cpu
+    Cpu * cpu = CpuCurrent();
+
+    if (!TimeEventPending(&sched->sliceEvent) && thread != cpu->thread && cpu->thread != cpu->idleThread)
+        SchedStartSlice(cpu, cpu->thread);
+}
+
+// Removes a thread from its queue
+static void SchedDelete(SchedCpuState * sched, Thread * thread)
+{
+    uint32_t priority = thread->priority;
+
+    SCHED_COUNT_OP();
+    ListDelete(&thread->runNode);
+    sched->load--;
+
+    if (ListIsEmpty(&sched->queues[priority]))
+    {
+        sched->bitmap[priority / 64] &= ~(1UL << (priority % 64));
+        if (sched->bitmap[priority / 64] == 0)
+            sched->summary &= ~(1UL << (priority / 64));
+    }
+}
+
+// Moves the current thread to the start or end of its queue
+static void SchedRequeue(SchedCpuState * sched, Thread * thread, bool front)
+{
+    if (SchedIsQueued(thread))
+        SchedDelete(sched, thread);
+
+    SchedInsert(sched, thread, front);
+}
+
+// Posts a thread's mail to another cpu
+//  There's no periodic tick to pick up requests, so the cpu is interrupted unless
+//  its mailbox already had something in it
+static void SchedMailPost(Thread * thread, Cpu * cpu, uint32_t type)
+{
+    thread->mail.type = type;
+
+    if (ThreadMailPost(cpu, &thread->mail))
+        CpuSendIpi(cpu, INTR_APIC_RESCHEDULE);
+}
+
+// Moves a runnable thread on this cpu to another cpu
+static void SchedMigrate(Thread * thread, Cpu * cpu)
+{
+    SchedRemove(thread);
+    IpcMigrate(thread);
+
+    // The thread belongs to the other cpu as soon as it's posted
+    thread->cpu = cpu;
+    SchedMailPost(thread, cpu, SCHED_MAIL_MIGRATE);
+}
+
+// Returns how far apart two cpus are (0 = same core, 3 = different NUMA nodes)
+static uint32_t SchedDistance(Cpu * a, Cpu * b)
+{
+    if (a->core == b->core)
+        return 0;
+    else if (a->package == b->package)
+        return 1;
+    else if (a->node == b->node)
+        return 2;
+    else
+        return 3;
+}
+
+// Wakes the closest idle cpu so it can steal one of this cpu's waiting threads
+static void SchedWakeIdle(Cpu * cpu)
+{
+    Cpu * target = NULL;
+
+    for (uint32_t i = 0; i < CpuCount; i++)
+    {
+        Cpu * other = CpuList[i];
+
+        if (other != cpu && other->thread == other->idleThread && !other->sched.stealing &&
+            (target == NULL || SchedDistance(cpu, other) < SchedDistance(cpu, target)))
+        {
+            target = other;
+        }
+    }
+
+    if (target)
+        CpuSendIpi(target, INTR_APIC_RESCHEDULE);
+}
+
+// Finds a queued thread which can be given to another cpu (or NULL if there isn't one)
+//  The highest priority waiting thread is chosen since it gains the most from moving
+static Thread * SchedFindStealable(Cpu * cpu, Cpu * to)
+{
+    SchedCpuState * sched = &cpu->sched;
+    Thread * thread;
+
+    for (int word = SCHED_BITMAP_WORDS - 1; word >= 0; word--)
+    {
+        uint64_t bits = sched->bitmap[word];
+
+        while (bits)
+        {
+            uint32_t bit = 63 - CLZ(bits);
+            bits &= ~(1UL << bit);
+
+            ListForEachSafe(thread, tmp, &sched->queues[word * 64 + bit], runNode)
+            {
+                // Drop blocked threads while we're here
+                if (thread->state != THREAD_STATE_RUNNING)
+                    SchedDelete(sched, thread);
+                else if (thread != cpu->thread && (thread->affinity == NULL || thread->affinity == to))
+                    return thread;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void SchedInitCpu(Cpu * cpu)
+{
+    SchedCpuState * sched = &cpu->sched;
+
+    STATIC_ASSERT(SCHED_PRIORITIES * sizeof(List) <= 0x1000);
+
+    sched->queues = KMemAllocate();
+    if (sched->queues == NULL)
+        Panic("SchedInitCpu: out of memory");
+
+    for (int i = 0; i < SCHED_PRIORITIES; i++)
+        ListInit(&sched->queues[i]);
+
+    sched->summary = 0;
+    for (int i = 0; i < SCHED_BITMAP_WORDS; i++)
+        sched->bitmap[i] = 0;
+
+    sched->load = 0;
+    TimeEventInit(&sched->sliceEvent, SchedSliceEnd);
+    sched->sliceOver = false;
+    sched->stealing = false;
+}
+
+void SchedAdd(Thread * thread)
+{
+    Cpu * cpu = CpuCurrent();
+
+    // Threads bound to another cpu move there when they are woken
+    if (thread->affinity && thread->affinity != cpu && thread != cpu->thread)
+        SchedMigrate(thread, thread->affinity);
+    else if (!SchedIsQueued(thread))
+        SchedInsert(&cpu->sched, thread, false);    // Blocked threads may still be queued
+}
+
+void SchedRemove(Thread * thread)
+{
+    if (SchedIsQueued(thread))
+        SchedDelete(&CpuCurrent()->sched, thread);
+}
+
+Thread * SchedNext(void)
+{
+    Cpu * cpu = CpuCurrent();
+    SchedCpuState * sched = &cpu->sched;
+
+    // Remove threads which blocked while queued until a runnable one is found
+    for (;;)
+    {
+        int priority = SchedHighest(sched);
+
+        if (priority < 0)
+            return cpu->idleThread;
+
+        Thread * thread = ListGet(sched->queues[priority].sentinal.next, Thread, runNode);
+
+        if (thread->state == THREAD_STATE_RUNNING)
+            return thread;
+
+        SchedDelete(sched, thread);
+    }
+}
+
+void SchedPreempt(void)
+{
+    Cpu * cpu = CpuCurrent();
+    Thread * current = cpu->thread;
+
+    // The idle loop runs threads itself
+    if (current == cpu->idleThread || SchedHighest(&cpu->sched) <= (int) current->priority)
+        return;
+
+    // The current thread keeps its place, so only threads ahead of it can run
+    if (!SchedIsQueued(current))
+        SchedInsert(&cpu->sched, current, true);
+
+    Thread * next = SchedNext();
+    if (next->priority > current->priority)
+        SchedSwitch(next);
+}
+
+void SchedSwitch(Thread * next)
+{
+    SchedStartSlice(CpuCurrent(), next);
+    ThreadSwitch(next);
+}
+
+void SchedYield(void)
+{
+    Cpu * cpu = CpuCurrent();
+    Thread * current = cpu->thread;
+
+    Assert(current != cpu->idleThread);
+
+    // This restarts the timeslice if the current thread is picked again
+    SchedRequeue(&cpu->sched, current, false);
+    SchedSwitch(SchedNext());
+}
+
+void SchedTimer(void)
+{
+    Cpu * cpu = CpuCurrent();
+    SchedCpuState * sched = &cpu->sched;
+
+    if (!sched->sliceOver || cpu->thread == cpu->idleThread)
+    {
+        SchedPreempt();
+        return;
+    }
+
+    // Give waiting threads to other cpus, then round robin between the rest
+    SchedWakeIdle(cpu);
+    SchedBalance();
+    SchedYield();
+}
+
+void SchedSetPriority(Thread * thread, uint8_t priority)
+{
+    Assert(thread->cpu == CpuCurrent());
+
+    // Queued threads move to their new queue
+    if (SchedIsQueued(thread))
+    {
+        SchedRemove(thread);
+        thread->priority = priority;
+        SchedAdd(thread);
+    }
+    else
+    {
+        thread->priority = priority;
+    }
+}
+
+void SchedSetAffinity(Thread * thread, Cpu * cpu)
+{
+    Assert(thread->cpu == CpuCurrent());
+
+    thread->affinity = cpu;
+
+#warning Todo move the current thread to its new cpu without waiting for it to block
+    if (cpu && cpu != thread->cpu && thread->state == THREAD_STATE_RUNNING &&
+        thread != ThreadCurrent())
+    {
+        SchedMigrate(thread, cpu);
+    }
+}
+
+void SchedBalance(void)
+{
+    Cpu * cpu = CpuCurrent();
+    Cpu * victim = NULL;
+    uint32_t victimDistance = 0;
+    uint32_t victimLoad = 0;
+
+    if (cpu->sched.stealing)
+        return;
+
+    // Find the busiest cpu in the closest group with a cpu worth stealing from
+    //  (moving a thread must make the load more even)
+    for (uint32_t i = 0; i < CpuCount; i++)
+    {
+        Cpu * other = CpuList[i];
+        uint32_t load = other->sched.load;
+        uint32_t distance = SchedDistance(cpu, other);
+
+        if (other == cpu || load <= cpu->sched.load + 1)
+            continue;
+
+        if (victim == NULL || distance < victimDistance ||
+            (distance == victimDistance && load > victimLoad))
+        {
+            victim = other;
+            victimDistance = distance;
+            victimLoad = load;
+        }
+    }
+
+    // The idle thread's mail is used for the request since there's one per cpu
+    if (victim)
+    {
+        cpu->sched.stealing = true;
+        cpu->idleThread->mail.type = SCHED_MAIL_STEAL;
+
+        if (ThreadMailPost(victim, &cpu->idleThread->mail))
+            CpuSendIpi(victim, INTR_APIC_RESCHEDULE);
+    }
+}
+
+void SchedMailHandle(Thread * thread)
+{
+    Cpu * cpu = CpuCurrent();
+
+    switch (thread->mail.type)
+    {
+        case SCHED_MAIL_MIGRATE:
+            SchedAdd(thread);
+            break;
+
+        case SCHED_MAIL_STEAL:
+        {
+            Thread * stolen = SchedFindStealable(cpu, thread->cpu);
+
+            if (stolen)
+                SchedMigrate(stolen, thread->cpu);
+
+            // The idle cpu must be woken even if nothing was stolen, or it would sleep
+            //  with mail waiting and never steal again
+            SchedMailPost(thread, thread->cpu, SCHED_MAIL_STEAL_DONE);
+            break;
+        }
+
+        case SCHED_MAIL_STEAL_DONE:
+            cpu->sched.stealing = false;
+            break;
+    }
+}
+
+SyscallResult SchedThreadSwitchSyscall(uint64_t destId, UNUSED uint64_t a2, UNUSED uint64_t a3,
+                                        UNUSED uint64_t a4, UNUSED uint64_t a5, UNUSED uint64_t a6)
+{
+    Thread * current = ThreadCurrent();
+    Thread * dest = (destId == THREAD_ID_NIL) ? NULL : ThreadLookup(destId);
+
+    // Donate the timeslice if the thread is waiting to run on this cpu
+    if (dest && dest != current && dest->cpu == current->cpu &&
+        dest->state == THREAD_STATE_RUNNING)
+    {
+        SchedRequeue(&current->cpu->sched, current, false);
+        ThreadSwitch(dest);
+    }
+    else
+    {
+        SchedYield();
+    }
+
+    return (SyscallResult) { 0, 0 };
+}
+
+SyscallResult SchedScheduleSyscall(uint64_t destId, UNUSED uint64_t timeControl,
+                                    uint64_t procControl, uint64_t prioControl,
+                                    UNUSED uint64_t preemptControl, UNUSED uint64_t a6)
+{
+    Thread * current = ThreadCurrent();
+    Thread * dest = ThreadLookup(destId);
+    uint64_t error = 0;
+
+    bool setPriority = ((uint32_t) prioControl != (uint32_t) -1);
+    bool setProcessor = ((uint32_t) procControl != (uint32_t) -1);
+
+#warning Todo time and preemption control
+    if (dest == NULL)
+    {
+        error = SCHED_ERROR_UNAVAILABLE;
+    }
+    else if (dest->scheduler != current->id && !ThreadIsPrivileged(current))
+    {
+        error = SCHED_ERROR_NO_PRIVILEGE;
+    }
+    else if ((setPriority && (prioControl & 0xFF) > current->priority) ||
+                (setProcessor && (uint32_t) procControl >= CpuCount))
+    {
+        error = SCHED_ERROR_INVALID_PARAM;
+    }
+    else if (setPriority || setProcessor)
+    {
+#warning Todo change the priority and processor of threads on other cpus
+        if (dest->cpu != current->cpu)
+        {
+            error = SCHED_ERROR_UNAVAILABLE;
+        }
+        else
+        {
+            if (setPriority)
+                SchedSetPriority(dest, prioControl & 0xFF);
+            if (setProcessor)
+                SchedSetAffinity(dest, CpuList[(uint32_t) procControl]);
+        }
+    }
+
+    if (error)
+    {
+        current->utcb->errorCode = error;
+        return (SyscallResult) { SCHED_RESULT_ERROR, 0 };
+    }
+
+    // Report what the thread is doing
+    uint64_t result;
+
+    switch (dest->state)
+    {
+        case THREAD_STATE_RUNNING:
+            result = SCHED_RESULT_RUNNING;
+            break;
+
+        case THREAD_STATE_SENDING:
+        case THREAD_STATE_CALLING:
+            result = SCHED_RESULT_SEND_WAIT;
+            break;
+
+        case THREAD_STATE_RECEIVING:
+            result = SCHED_RESULT_RECV_WAIT;
+            break;
+
+        default:
+            result = SCHED_RESULT_INACTIVE;
+            break;
+    }
+
+    // A higher priority thread may now be runnable
+    SchedPreempt();
+    return (SyscallResult) { result, 0 };
+}
@@ -0,0 +1,315 @@
+/*
+ * kernel/src/slab.c
+ * Slab allocator for fixed size kernel objects
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "slab.h"
+#include "atomic.h"
+#include "cpu.h"
+#include "kmemory.h"
+#include "list.h"
+
+// Header at the start of each slab
+//  Slabs are buddy blocks so the header is found by masking an object's address
+typedef struct SlabPage
+{
+    ListNode node;              // Node in one of the cache's slab lists
+    void * freeList;            // First free object in this slab
+    uint32_t inUse;             // Number of objects not in the free list
+
+} SlabPage;
+
+// Rounds value up to a multiple of align (a power of 2)
+static inline uint32_t SlabRoundUp(uint32_t value, uint32_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Returns the smallest block order able to hold the given number of bytes
+static uint32_t SlabOrderFor(uint64_t bytes)
+{
+    uint32_t order = 0;
+
+    while ((0x1000UL << order) < bytes)
+        order++;
+
+    return order;
+}
+
+// Returns the free list link of an object
+static inline void ** SlabLink(SlabCache * cache, void * object)
+{
+    return (void **) ((char *) object + cache->linkOffset);
+}
+
+// Returns the slab containing an object
+static inline SlabPage * SlabPageOf(SlabCache * cache, void * object)
+{
+    return (SlabPage *) ((uintptr_t) object & ~((0x1000UL << cache->order) - 1));
+}
+
+// Allocates a new slab and constructs all its objects
+//  The cache must not be locked
+static SlabPage * SlabCreate(SlabCache * cache, uint32_t colour)
+{
+    SlabPage * slab;
+
+    if (cache->order == 0)
+        slab = KMemAllocate();
+    else
+        slab = KMemAllocateOrder(cache->order);
+
+    if (slab == NULL)
+        return NULL;
+
+    slab->freeList = NULL;
+    slab->inUse = 0;
+
+    // Build the free list backwards so objects are handed out in address order
+    char * first = (char *) slab + cache->firstOffset + colour;
+
+    for (uint32_t i = cache->objsPerSlab; i > 0; i--)
+    {
+        void * object = first + (i - 1) * cache->objSize;
+
+        if (cache->ctor)
+            cache->ctor(object);
+
+        *SlabLink(cache, object) = slab->freeList;
+        slab->freeList = object;
+    }
+
+    return slab;
+}
+
+// Frees the memory used by a slab
+static void SlabDestroy(SlabCache * cache, SlabPage * slab)
+{
+    if (cache->order == 0)
+        KMemFree(slab);
+    else
+        KMemFreeOrder(slab, cache->order);
+}
+
+void SlabCacheInit(SlabCache * cache, uint32_t size, uint32_t align, SlabConstructor ctor)
+{
+    Assert(size > 0);
+    Assert(align <= 0x1000 && (align & (align - 1)) == 0);
+    Assert(CpuCount > 0);
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    // The free list link normally overlaps the object
+    //  Constructed objects must keep their contents so the link goes after them
+    if (ctor)
+    {
+        cache->linkOffset = SlabRoundUp(size, sizeof(void *));
+        cache->objSize = cache->linkOffset + sizeof(void *);
+    }
+    else
+    {
+        cache->linkOffset = 0;
+        cache->objSize = (size < sizeof(void *)) ? sizeof(void *) : size;
+    }
+
+    cache->objSize = SlabRoundUp(cache->objSize, align);
+    cache->firstOffset = SlabRoundUp(sizeof(SlabPage), align);
+
+    // Use larger slabs until enough objects fit in each one
+    cache->order = 0;
+    while (cache->order < KMEM_MAX_ORDER &&
+        ((0x1000U << cache->order) - cache->firstOffset) / cache->objSize < SLAB_MIN_OBJECTS)
+    {
+        cache->order++;
+    }
+
+    uint32_t slabSize = 0x1000U << cache->order;
+    Assert(slabSize - cache->firstOffset >= cache->objSize);
+
+    cache->objsPerSlab = (slabSize - cache->firstOffset) / cache->objSize;
+
+    // The space left at the end of each slab is used to offset the objects
+    //  so objects in different slabs don't all compete for the same cache sets
+    uint32_t unused = slabSize - cache->firstOffset - cache->objsPerSlab * cache->objSize;
+
+    cache->colourStep = (align > SLAB_CACHE_LINE) ? align : SLAB_CACHE_LINE;
+    cache->colourMax = unused & ~(cache->colourStep - 1);
+    cache->colourNext = 0;
+    cache->ctor = ctor;
+
+    AtomicLockInit(&cache->lock);
+    ListInit(&cache->partial);
+    ListInit(&cache->full);
+    ListInit(&cache->empty);
+    cache->emptyCount = 0;
+
+    // Allocate the per-cpu caches
+    cache->cpuCaches = KMemAllocateOrder(SlabOrderFor(CpuCount * sizeof(SlabCpuCache)));
+    if (cache->cpuCaches == NULL)
+        Panic("SlabCacheInit: out of memory");
+
+    for (uint32_t i = 0; i < CpuCount; i++)
+        cache->cpuCaches[i].count = 0;
+}
+
+// Moves objects from the slabs into a cpu cache
+//  Returns false if no objects could be allocated
+static bool SlabRefill(SlabCache * cache, SlabCpuCache * cpuCache)
+{
+    AtomicLock(&cache->lock);
+
+    while (cpuCache->count < SLAB_CPU_CACHE_BATCH)
+    {
+        SlabPage * slab;
+
+        // Prefer partial slabs so empty ones can be freed
+        if (!ListIsEmpty(&cache->partial))
+        {
+            slab = ListGet(cache->partial.sentinal.next, SlabPage, node);
+        }
+        else if (!ListIsEmpty(&cache->empty))
+        {
+            slab = ListGet(cache->empty.sentinal.next, SlabPage, node);
+            ListDelete(&slab->node);
+            ListAddFirst(&cache->partial, &slab->node);
+            cache->emptyCount--;
+        }
+        else
+        {
+            // Create a new slab without holding the lock
+            uint32_t colour = cache->colourNext;
+
+            cache->colourNext += cache->colourStep;
+            if (cache->colourNext > cache->colourMax)
+                cache->colourNext = 0;
+
+            AtomicUnlock(&cache->lock);
+            slab = SlabCreate(cache, colour);
+            AtomicLock(&cache->lock);
+
+            if (slab == NULL)
+                break;
+
+            ListAddFirst(&cache->partial, &slab->node);
+        }
+
+        // Take as many objects as possible from this slab
+        while (cpuCache->count < SLAB_CPU_CACHE_BATCH && slab->freeList != NULL)
+        {
+            void * object = slab->freeList;
+
+            slab->freeList = *SlabLink(cache, object);
+            slab->inUse++;
+            cpuCache->objects[cpuCache->count++] = object;
+        }
+
+        if (slab->freeList == NULL)
+        {
+            ListDelete(&slab->node);
+            ListAddFirst(&cache->full, &slab->node);
+        }
+    }
+
+    AtomicUnlock(&cache->lock);
+    return cpuCache->count > 0;
+}
+
+// Returns the oldest batch of objects in a cpu cache to their slabs
+static void SlabDrain(SlabCache * cache, SlabCpuCache * cpuCache)
+{
+    List unused;
+    SlabPage * slab;
+
+    ListInit(&unused);
+    AtomicLock(&cache->lock);
+
+    for (uint32_t i = 0; i < SLAB_CPU_CACHE_BATCH; i++)
+    {
+        void * object = cpuCache->objects[i];
+
+        slab = SlabPageOf(cache, object);
+
+        // Full slabs become partial again
+        if (slab->freeList == NULL)
+        {
+            ListDelete(&slab->node);
+            ListAddFirst(&cache->partial, &slab->node);
+        }
+
+        *SlabLink(cache, object) = slab->freeList;
+        slab->freeList = object;
+        slab->inUse--;
+
+        // Keep a few empty slabs and free the rest
+        if (slab->inUse == 0)
+        {
+            ListDelete(&slab->node);
+
+            if (cache->emptyCount < SLAB_MAX_EMPTY)
+            {
+                ListAddFirst(&cache->empty, &slab->node);
+                cache->emptyCount++;
+            }
+            else
+            {
+                ListAddFirst(&unused, &slab->node);
+            }
+        }
+    }
+
+    AtomicUnlock(&cache->lock);
+
+    // Free unused slabs after the cache is unlocked
+    ListForEachSafe(slab, tmp, &unused, node)
+        SlabDestroy(cache, slab);
+
+    cpuCache->count -= SLAB_CPU_CACHE_BATCH;
+    memcpy(cpuCache->objects, cpuCache->objects + SLAB_CPU_CACHE_BATCH,
+            cpuCache->count * sizeof(void *));
+}
+
+void * SlabAllocate(SlabCache * cache)
+{
+    // The kernel is not preemptible so the cpu can't change under us
+    SlabCpuCache * cpuCache = &cache->cpuCaches[CpuCurrent()->id];
+
+    if (cpuCache->count == 0 && !SlabRefill(cache, cpuCache))
+        return NULL;
+
+    return cpuCache->objects[--cpuCache->count];
+}
+
+void SlabFree(SlabCache * cache, void * object)
+{
+    // Ignore NULL free
+    if (object == NULL)
+        return;
+
+    Assert(((uintptr_t) object - (uintptr_t) SlabPageOf(cache, object)) >= cache->firstOffset);
+
+    SlabCpuCache * cpuCache = &cache->cpuCaches[CpuCurrent()->id];
+
+    // Drain the oldest objects if the cache is full
+    //  The cache holds two batches so the memcpy regions never overlap
+    if (cpuCache->count == SLAB_CPU_CACHE_SIZE)
+        SlabDrain(cache, cpuCache);
+
+    cpuCache->objects[cpuCache->count++] = object;
+}
@@ -0,0 +1,69 @@
+/*
+ * kernel/src/syscall.c
+ * System call dispatch
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "ipc.h"
+#include "mapdb.h"
+#include "sched.h"
+#include "syscall.h"
+#include "thread.h"
+
+// Handler for system calls which haven't been implemented
+static SyscallResult SyscallNotImplemented(UNUSED uint64_t a1, UNUSED uint64_t a2, UNUSED uint64_t a3,
+                                            UNUSED uint64_t a4, UNUSED uint64_t a5, UNUSED uint64_t a6)
+{
+#warning Todo remaining system calls
+    return (SyscallResult) { 0, 0 };
+}
+
+// Unmap
+//  control bits 5-0 = number of fpages in the message registers - 1
+//  control bit  6   = also revoke the rights from the caller's own mappings
+static SyscallResult SyscallUnmap(uint64_t control, UNUSED uint64_t a2, UNUSED uint64_t a3,
+                                    UNUSED uint64_t a4, UNUSED uint64_t a5, UNUSED uint64_t a6)
+{
+    Thread * thread = ThreadCurrent();
+    uint32_t count = (control & 0x3F) + 1;
+    bool flush = (control & 0x40) != 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        MapUnmap(thread->space, thread->utcb->mr[i], flush);
+
+        // Page access bits aren't tracked so the returned status is always empty
+        thread->utcb->mr[i] &= ~(MapFpage) MAP_RIGHTS_ALL;
+    }
+
+    return (SyscallResult) { 0, 0 };
+}
+
+const SyscallHandler SyscallTable[SYSCALL_COUNT] =
+{
+    [SYSCALL_SPACE_CONTROL]         = SyscallNotImplemented,
+    [SYSCALL_THREAD_CONTROL]        = ThreadControlSyscall,
+    [SYSCALL_PROCESSOR_CONTROL]     = SyscallNotImplemented,
+    [SYSCALL_MEMORY_CONTROL]        = SyscallNotImplemented,
+    [SYSCALL_IPC]                   = IpcSyscall,
+    [SYSCALL_LIPC]                  = IpcLocalSyscall,
+    [SYSCALL_UNMAP]                 = SyscallUnmap,
+    [SYSCALL_EXCHANGE_REGISTERS]    = SyscallNotImplemented,
+    [SYSCALL_THREAD_SWITCH]         = SchedThreadSwitchSyscall,
+    [SYSCALL_SCHEDULE]              = SchedScheduleSyscall,
+};
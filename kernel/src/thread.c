@@ -0,0 +1,511 @@
+/*
+ * kernel/src/thread.c
+ * Threads and thread switching
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "atomic.h"
+#include "cpu.h"
+#include "ipc.h"
+#include "kmemory.h"
+#include "list.h"
+#include "mapdb.h"
+#include "memory.h"
+#include "sched.h"
+#include "slab.h"
+#include "thread.h"
+
+// Table of threads indexed by thread number
+Thread ** ThreadTable;
+
+// Address space of the root server
+#warning Todo create the root server
+MemSpace * ThreadRootSpace;
+
+// Cache of address spaces
+//  Threads (with their kernel stacks) are whole pages from KMemAllocate, since a slab
+//  of page aligned pages would waste a page on its header
+static SlabCache ThreadSpaceCache;
+
+// Lock protecting changes to the thread table and the thread counts of address spaces
+static AtomicSpinlock ThreadTableLock;
+
+// Lock protecting the allocation of UTCB pages
+static AtomicSpinlock ThreadUtcbLock;
+
+// Saves the current stack pointer in oldRsp and continues on newRsp
+void ThreadSwitchStack(uint64_t * oldRsp, uint64_t newRsp);
+
+// Enters user mode for the first time (never returns)
+void NO_RETURN ThreadEnterUser(uint64_t ip, uint64_t sp);
+
+void ThreadInit(void)
+{
+    // Allocate the thread table
+    uint64_t tableSize = THREAD_TABLE_SIZE * sizeof(Thread *);
+    uint32_t order = 0;
+
+    while ((0x1000UL << order) < tableSize)
+        order++;
+
+    ThreadTable = KMemAllocateOrder(order);
+    if (ThreadTable == NULL)
+        Panic("ThreadInit: out of memory");
+
+    memset(ThreadTable, 0, tableSize);
+
+    // Threads are allocated as single pages
+    STATIC_ASSERT(THREAD_SIZE == MEM_PAGE_4KB);
+    SlabCacheInit(&ThreadSpaceCache, sizeof(MemSpace), SLAB_CACHE_LINE, NULL);
+
+    AtomicLockInit(&ThreadTableLock);
+    AtomicLockInit(&ThreadUtcbLock);
+}
+
+void ThreadInitCpu(Cpu * cpu)
+{
+    Thread * idle = KMemAllocate();
+    if (idle == NULL)
+        Panic("ThreadInitCpu: out of memory");
+
+    memset(idle, 0, sizeof(Thread));
+    idle->state = THREAD_STATE_RUNNING;
+    idle->cpu = cpu;
+    ListInit(&idle->senders);
+    ListInit(&idle->receivers);
+
+    cpu->idleThread = idle;
+    cpu->thread = idle;
+}
+
+// Returns the thread in a space with a local id (or NULL)
+//  ThreadTableLock must be held
+static Thread * ThreadFindLocal(MemSpace * space, uint64_t localId)
+{
+    Thread * thread;
+
+    ListForEach(thread, &space->threads, spaceNode)
+    {
+        if (thread->utcb && thread->localId == localId)
+            return thread;
+    }
+
+    return NULL;
+}
+
+Thread * ThreadLookupLocal(MemSpace * space, uint64_t localId)
+{
+    AtomicLock(&ThreadTableLock);
+    Thread * thread = ThreadFindLocal(space, localId);
+    AtomicUnlock(&ThreadTableLock);
+
+    return thread;
+}
+
+bool ThreadSetUtcb(Thread * thread, uint64_t addr)
+{
+    MemSpace * space = thread->space;
+    uint64_t page = addr & ~(MEM_PAGE_4KB - 1);
+    uint64_t pAddr, flags, size;
+    bool result = true;
+
+    if (space == NULL || (addr & (UTCB_SIZE - 1)) || addr >= MEM_USER_MAP_END)
+        return false;
+
+    // Each UTCB belongs to one thread (threads are only added and deleted with
+    //  ThreadTableLock held, which the caller has)
+    if (ThreadFindLocal(space, addr))
+        return false;
+
+#warning Todo restrict UTCBs to the UTCB area given to SpaceControl
+    AtomicLock(&ThreadUtcbLock);
+
+    if (MemSpaceLookup(space, page, &pAddr, &flags))
+    {
+        // The page must be a UTCB page allocated below (no mapping node, writable, 4KB)
+        if (MemSpaceGetData(space, page, &size) != NULL ||
+            (flags & (MEM_PAGE_WRITABLE | MEM_PAGE_LARGE)) != MEM_PAGE_WRITABLE)
+        {
+            result = false;
+        }
+    }
+    else
+    {
+        void * utcbPage = KMemZAllocate();
+
+        if (utcbPage == NULL)
+        {
+            result = false;
+        }
+        else
+        {
+            // The page belongs to the space now (MemSpaceDestroy frees it)
+            pAddr = KMemToPhysical(utcbPage);
+            result = MemSpaceMap(space, page, pAddr, MEM_PAGE_4KB,
+                                    MEM_PAGE_USER | MEM_PAGE_WRITABLE | MEM_PAGE_NX);
+
+            if (!result)
+                KMemFree(utcbPage);
+        }
+    }
+
+    AtomicUnlock(&ThreadUtcbLock);
+
+    if (!result)
+        return false;
+
+    Utcb * utcb = (Utcb *) ((uint8_t *) KMemFromPhysical(pAddr & ~(MEM_PAGE_4KB - 1)) +
+                            (addr & (MEM_PAGE_4KB - 1)));
+
+    memset(utcb, 0, sizeof(Utcb));
+    utcb->myLocalId = addr;
+    utcb->myGlobalId = thread->id;
+    utcb->processorNo = thread->cpu ? thread->cpu->id : 0;
+
+    thread->utcb = utcb;
+    thread->localId = addr;
+    return true;
+}
+
+// First code run by new threads
+//  The thread is activated waiting for its start message, so when this runs the
+//  message from the pager is in the message registers
+static void NO_RETURN ThreadStart(void)
+{
+    Thread * thread = ThreadCurrent();
+    Utcb * utcb = thread->utcb;
+
+    // iretq faults in the kernel on a non-canonical instruction pointer, so messages
+    // with one are ignored and the thread waits for another start message (as it does
+    // if the wait was aborted because the pager was deleted)
+    while (utcb->errorCode || utcb->mr[1] >= MEM_USER_END)
+    {
+        Thread * pager = ThreadLookup(thread->pager);
+
+        utcb->errorCode = 0;
+        IpcWaitFrom(thread, pager);
+        ThreadBlock(pager ? THREAD_STATE_RECEIVING : THREAD_STATE_INACTIVE);
+    }
+
+    ThreadEnterUser(utcb->mr[1], utcb->mr[2]);
+}
+
+// Creates a new inactive thread
+//  space = address space to run in (NULL = create a new one)
+//  ThreadTableLock must be held
+static uint64_t ThreadCreate(uint64_t id, MemSpace * space, uint64_t scheduler, Thread ** result)
+{
+    Thread * thread = KMemAllocate();
+    if (thread == NULL)
+        return THREAD_ERROR_OUT_OF_MEMORY;
+
+    if (space == NULL)
+    {
+        space = SlabAllocate(&ThreadSpaceCache);
+
+        if (space == NULL || !MemSpaceInit(space))
+        {
+            if (space)
+                SlabFree(&ThreadSpaceCache, space);
+
+            KMemFree(thread);
+            return THREAD_ERROR_OUT_OF_MEMORY;
+        }
+
+        ListInit(&space->threads);
+    }
+
+    memset(thread, 0, sizeof(Thread));
+    thread->state = THREAD_STATE_INACTIVE;
+    thread->priority = THREAD_DEFAULT_PRIORITY;
+    thread->id = id;
+    thread->cpu = CpuCurrent();
+    thread->space = space;
+    thread->scheduler = scheduler;
+    ListInit(&thread->senders);
+    ListInit(&thread->receivers);
+    AtomicLockInit(&thread->receiversLock);
+    TimeEventInit(&thread->timeout, IpcTimeout);
+
+    // The first switch to the thread returns to ThreadStart (aligned like a call)
+    uint64_t * stack = (uint64_t *) ThreadStackTop(thread);
+
+    *--stack = 0;
+    *--stack = (uint64_t) ThreadStart;
+    stack -= 6;
+    memset(stack, 0, 6 * sizeof(uint64_t));
+    thread->kernelRsp = (uint64_t) stack;
+
+    ListAddLast(&space->threads, &thread->spaceNode);
+
+    // Publish the thread once it's initialized
+    AtomicBarrier();
+    ThreadTable[id >> THREAD_ID_VERSION_BITS] = thread;
+
+    *result = thread;
+    return 0;
+}
+
+// Unmaps and frees an address space with no threads left
+//  Called without ThreadTableLock since unmapping waits for the other cpus
+static void ThreadSpaceDestroy(MemSpace * space)
+{
+    MapUnmap(space, MAP_FPAGE_COMPLETE | MAP_RIGHTS_ALL, true);
+    MemSpaceDestroy(space);
+    SlabFree(&ThreadSpaceCache, space);
+}
+
+// Deletes a thread on the current cpu
+//  ThreadTableLock must be held
+//  If this was the last thread in its space, the space is stored in deadSpace to be destroyed
+static uint64_t ThreadDelete(Thread * thread, MemSpace ** deadSpace)
+{
+#warning Todo delete threads running on other cpus
+    if (thread == ThreadCurrent() || thread->cpu != CpuCurrent() || !IpcCancel(thread))
+        return THREAD_ERROR_UNAVAILABLE;
+
+    SchedRemove(thread);
+
+    ThreadTable[thread->id >> THREAD_ID_VERSION_BITS] = NULL;
+    thread->id = THREAD_ID_NIL;
+
+    // Delete the address space with its last thread
+    ListDelete(&thread->spaceNode);
+
+    if (ListIsEmpty(&thread->space->threads))
+        *deadSpace = thread->space;
+
+    // Other cpus may still be using the thread, so it's freed later
+    IpcDelete(thread);
+    return 0;
+}
+
+// Changes the settings of an existing or new thread
+//  ThreadTableLock must be held (see ThreadDelete for deadSpace)
+static uint64_t ThreadConfigure(Thread * caller, uint64_t destId, uint64_t spaceId,
+                                uint64_t schedulerId, uint64_t pagerId, uint64_t utcbAddr,
+                                MemSpace ** deadSpace)
+{
+    Thread * dest = ThreadTable[destId >> THREAD_ID_VERSION_BITS];
+    MemSpace * space = NULL;
+    uint64_t error;
+
+    // Thread numbers are only reused after the old thread is deleted
+    if (dest && dest->id != destId)
+        return THREAD_ERROR_UNAVAILABLE;
+
+    if (spaceId == THREAD_ID_NIL)
+        return dest ? ThreadDelete(dest, deadSpace) : THREAD_ERROR_UNAVAILABLE;
+
+    // Check everything before changing anything
+    if (spaceId != destId)
+    {
+        Thread * spaceThread = ThreadLookup(spaceId);
+
+        if (spaceThread == NULL || spaceThread->space == NULL)
+            return THREAD_ERROR_INVALID_SPACE;
+
+        space = spaceThread->space;
+    }
+
+#warning Todo move threads between address spaces
+    if (dest && space && space != dest->space)
+        return THREAD_ERROR_INVALID_SPACE;
+
+    if (schedulerId != THREAD_ID_NIL && ThreadLookup(schedulerId) == NULL)
+        return THREAD_ERROR_INVALID_SCHEDULER;
+
+    if (pagerId != THREAD_ID_NIL && ThreadLookup(pagerId) == NULL)
+        return THREAD_ERROR_INVALID_PAGER;
+
+    if (utcbAddr != (uint64_t) -1 && dest && dest->utcb && dest->localId != utcbAddr)
+        return THREAD_ERROR_INVALID_UTCB;
+
+    if (dest == NULL)
+    {
+        if (schedulerId == THREAD_ID_NIL)
+            schedulerId = caller->id;
+
+        error = ThreadCreate(destId, space, schedulerId, &dest);
+        if (error)
+            return error;
+
+        if (utcbAddr != (uint64_t) -1 && !ThreadSetUtcb(dest, utcbAddr))
+        {
+            ThreadDelete(dest, deadSpace);
+            return THREAD_ERROR_INVALID_UTCB;
+        }
+    }
+    else
+    {
+        if (schedulerId != THREAD_ID_NIL)
+            dest->scheduler = schedulerId;
+
+        if (utcbAddr != (uint64_t) -1 && dest->utcb == NULL && !ThreadSetUtcb(dest, utcbAddr))
+            return THREAD_ERROR_INVALID_UTCB;
+    }
+
+    if (pagerId != THREAD_ID_NIL)
+    {
+        dest->pager = pagerId;
+
+        if (dest->utcb)
+            dest->utcb->pager = pagerId;
+    }
+
+    // Threads start once they have a pager and a UTCB by waiting for the start message
+    //  An old pager may have been deleted, and a NULL partner would accept any thread
+    if (dest->state == THREAD_STATE_INACTIVE && dest->pager != THREAD_ID_NIL && dest->utcb)
+    {
+        Thread * pager = ThreadLookup(dest->pager);
+
+        if (pager)
+        {
+            IpcWaitFrom(dest, pager);
+            dest->state = THREAD_STATE_RECEIVING;
+        }
+    }
+
+    return 0;
+}
+
+SyscallResult ThreadControlSyscall(uint64_t destId, uint64_t spaceId, uint64_t schedulerId,
+                                    uint64_t pagerId, uint64_t utcbAddr, UNUSED uint64_t a6)
+{
+    Thread * thread = ThreadCurrent();
+    uint64_t number = destId >> THREAD_ID_VERSION_BITS;
+    uint64_t error;
+
+    if (!ThreadIsPrivileged(thread))
+    {
+        error = THREAD_ERROR_NO_PRIVILEGE;
+    }
+    else if (number < THREAD_USER_BASE || number >= THREAD_TABLE_SIZE ||
+                (destId & THREAD_ID_VERSION_MASK) == 0)
+    {
+        error = THREAD_ERROR_UNAVAILABLE;
+    }
+    else
+    {
+        MemSpace * deadSpace = NULL;
+
+        AtomicLock(&ThreadTableLock);
+        error = ThreadConfigure(thread, destId, spaceId, schedulerId, pagerId, utcbAddr,
+                                &deadSpace);
+        AtomicUnlock(&ThreadTableLock);
+
+        if (deadSpace)
+            ThreadSpaceDestroy(deadSpace);
+    }
+
+    if (error)
+    {
+        thread->utcb->errorCode = error;
+        return (SyscallResult) { 0, 0 };
+    }
+
+    return (SyscallResult) { 1, 0 };
+}
+
+void ThreadSwitch(Thread * to)
+{
+    Cpu * cpu = CpuCurrent();
+    Thread * from = cpu->thread;
+
+    if (from == to)
+        return;
+
+    // Kernel threads run in whatever space was last loaded
+    //  Threads in the same space (like local IPC partners) skip the page table switch
+    if (to->space)
+    {
+        if (to->space != from->space)
+            MemSpaceSwitch(to->space);
+
+        CpuSetKernelStack(cpu, ThreadStackTop(to));
+
+        // User mode finds its UTCB at gs:0
+        if (to->utcb)
+            CpuWriteMsr(CPU_MSR_KERNEL_GS_BASE, to->localId);
+    }
+
+    cpu->thread = to;
+    ThreadSwitchStack(&from->kernelRsp, to->kernelRsp);
+}
+
+void ThreadBlock(uint32_t state)
+{
+    Cpu * cpu = CpuCurrent();
+
+    Assert(cpu->thread != cpu->idleThread);
+    cpu->thread->state = state;
+
+    SchedSwitch(SchedNext());
+}
+
+void ThreadWake(Thread * thread)
+{
+    thread->state = THREAD_STATE_RUNNING;
+    TimeEventCancel(&thread->timeout);
+    SchedAdd(thread);
+}
+
+void ThreadFree(Thread * thread)
+{
+    KMemFree(thread);
+}
+
+bool ThreadMailPost(Cpu * cpu, ThreadMail * mail)
+{
+    ThreadMail * head = cpu->mailbox;
+    ThreadMail * old;
+
+    // Push onto the front of the mailbox
+    do
+    {
+        old = head;
+        mail->next = old;
+        head = AtomicCompareSwap(&cpu->mailbox, old, mail);
+    }
+    while (head != old);
+
+    return old == NULL;
+}
+
+ThreadMail * ThreadMailTake(void)
+{
+    Cpu * cpu = CpuCurrent();
+
+    // Only this cpu removes requests, so there are no ABA problems
+    if (cpu->mailbox == NULL)
+        return NULL;
+
+    ThreadMail * mail = AtomicExchange(&cpu->mailbox, NULL);
+    ThreadMail * ordered = NULL;
+
+    // Reverse the list so requests are handled in the order they were posted
+    while (mail)
+    {
+        ThreadMail * next = mail->next;
+        mail->next = ordered;
+        ordered = mail;
+        mail = next;
+    }
+
+    return ordered;
+}
@@ -0,0 +1,89 @@
+/*
+ * kernel/src/thread_asm.s
+ * Thread switching
+ *
+ * Copyright (C) 2013 James Cowgill
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+.code64
+.intel_syntax noprefix
+
+.global ThreadSwitchStack
+.global ThreadEnterUser
+
+# User mode segments (see MSR_STAR)
+.set USER_CODE_SELECTOR, 0x23
+.set USER_DATA_SELECTOR, 0x1B
+
+.text
+    .align 16
+ThreadSwitchStack:
+    # void ThreadSwitchStack(uint64_t * oldRsp, uint64_t newRsp)
+    #  rdi = where to save the old stack pointer
+    #  rsi = new stack pointer
+    #  Only registers preserved across C function calls need saving
+
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+
+    # Switch stacks
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+    .align 16
+ThreadEnterUser:
+    # void ThreadEnterUser(uint64_t ip, uint64_t sp)
+    #  rdi = user instruction pointer
+    #  rsi = user stack pointer
+    #  The rest of the kernel stack is discarded
+
+    push USER_DATA_SELECTOR
+    push rsi
+    push 0x202              # Interrupts enabled
+    push USER_CODE_SELECTOR
+    push rdi
+
+    # Don't leak kernel values to user mode
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    xor r8, r8
+    xor r9, r9
+    xor r10, r10
+    xor r11, r11
+    xor r12, r12
+    xor r13, r13
+    xor r14, r14
+    xor r15, r15
+
+    swapgs
+    iretq
@@ -19,8 +19,264 @@
  */
 
 #include "global.h"
+#include "cpu.h"
+#include "kmemory.h"
+#include "list.h"
+#include "sched.h"
 #include "time.h"
 
+// Time stamp counter value at time 0
+static uint64_t TimeTscBase;
+
+// Microseconds per TSC tick and TSC ticks per microsecond (32.32 fixed point)
+static uint64_t TimeUsPerTsc;
+static uint64_t TimeTscPerUs;
+
+void TimeInit(void)
+{
+    TimeTscBase = CpuReadTsc();
+    TimeUsPerTsc = (1000000UL << 32) / CpuTscFreq;
+    TimeTscPerUs = (CpuTscFreq << 32) / 1000000;
+
+    // User mode reads the clock without entering the kernel (see scSystemClock)
+    InfoPage.clockBase = TimeTscBase;
+    InfoPage.clockMult = TimeUsPerTsc;
+}
+
+uint64_t TimeNow(void)
+{
+    return ((unsigned __int128) (CpuReadTsc() - TimeTscBase) * TimeUsPerTsc) >> 32;
+}
+
+// Returns the slot list for the given level and index
+static inline List * TimeSlot(TimeWheel * wheel, uint32_t level, uint32_t index)
+{
+    return &wheel->slots[level * TIME_WHEEL_SLOTS + index];
+}
+
+// Returns the first tick at or after a time
+static inline uint64_t TimeToTick(uint64_t time)
+{
+    return (time >> TIME_WHEEL_TICK_LOG2) + ((time & (TIME_WHEEL_TICK - 1)) != 0);
+}
+
+// Returns true if there are no events in a wheel
+static inline bool TimeWheelIsEmpty(TimeWheel * wheel)
+{
+    uint64_t bits = 0;
+
+    for (uint32_t level = 0; level < TIME_WHEEL_LEVELS; level++)
+        bits |= wheel->occupied[level];
+
+    return bits == 0;
+}
+
+// Sets the current cpu's timer to interrupt once at the given time (TIME_NEVER = stop it)
+//  Times in the past interrupt immediately. The interrupt may also come early
+static void TimeSetTimer(TimeWheel * wheel, uint64_t time)
+{
+    if (wheel->deadline == time)
+        return;
+
+    wheel->deadline = time;
+
+    // Round up so the interrupt doesn't arrive before the time
+    if (time == TIME_NEVER)
+        CpuSetTimer(0);
+    else
+        CpuSetTimer(TimeTscBase + (((unsigned __int128) time * TimeTscPerUs) >> 32) + 1);
+}
+
+// Puts an event in the slot of the lowest level which reaches it
+//  Returns the tick the wheel next has to be processed for the event
+static uint64_t TimeWheelInsert(TimeWheel * wheel, TimeEvent * event)
+{
+    const uint64_t range = 1UL << (TIME_WHEEL_LEVELS * TIME_WHEEL_SLOTS_LOG2);
+    uint64_t tick = TimeToTick(event->time);
+    uint32_t level = 0;
+
+    // Events which are already due run at the next tick, and events past the end of
+    //  the wheel wait in its last slot (they're put back when it's cascaded)
+    if (tick < wheel->now)
+        tick = wheel->now;
+    else if (tick - wheel->now >= range)
+        tick = wheel->now + range - 1;
+
+    while ((tick - wheel->now) >> ((level + 1) * TIME_WHEEL_SLOTS_LOG2))
+        level++;
+
+    uint32_t index = (tick >> (level * TIME_WHEEL_SLOTS_LOG2)) % TIME_WHEEL_SLOTS;
+
+    ListAddLast(TimeSlot(wheel, level, index), &event->node);
+    wheel->occupied[level] |= 1UL << index;
+    return tick;
+}
+
+// Removes an event from its slot
+static void TimeWheelDelete(TimeWheel * wheel, TimeEvent * event)
+{
+    ListNode * next = event->node.next;
+
+    ListDelete(&event->node);
+
+    // Only the slot's sentinal points to itself once it's empty
+    if (next->next == next)
+    {
+        uint32_t slot = (uint32_t) (ListGet(next, List, sentinal) - wheel->slots);
+        wheel->occupied[slot / TIME_WHEEL_SLOTS] &= ~(1UL << (slot % TIME_WHEEL_SLOTS));
+    }
+}
+
+// Returns the next tick which has a level 0 slot to run or a slot to cascade
+//  (TIME_NEVER if the wheel is empty)
+static uint64_t TimeWheelNext(TimeWheel * wheel)
+{
+    uint64_t next = TIME_NEVER;
+
+    for (uint32_t level = 0; level < TIME_WHEEL_LEVELS; level++)
+    {
+        uint64_t bits = wheel->occupied[level];
+        uint32_t shift = level * TIME_WHEEL_SLOTS_LOG2;
+
+        if (bits == 0)
+            continue;
+
+        // Each slot is handled at the start of its block of ticks, so the current
+        //  block's slot has already been done unless the block starts now
+        uint64_t block = wheel->now >> shift;
+
+        if (wheel->now & ((1UL << shift) - 1))
+            block++;
+
+        // Search the slots from the block's slot onwards (wrapping around)
+        uint32_t start = block % TIME_WHEEL_SLOTS;
+
+        if (start)
+            bits = (bits >> start) | (bits << (TIME_WHEEL_SLOTS - start));
+
+        uint64_t tick = (block + CTZ(bits)) << shift;
+
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+// Moves the events in a slot down to the lower levels
+static void TimeWheelCascade(TimeWheel * wheel, uint32_t level, uint32_t index)
+{
+    List * slot = TimeSlot(wheel, level, index);
+
+    while (!ListIsEmpty(slot))
+    {
+        TimeEvent * event = ListGet(slot->sentinal.next, TimeEvent, node);
+
+        TimeWheelDelete(wheel, event);
+        TimeWheelInsert(wheel, event);
+    }
+}
+
+// Runs all the events due at or before the given time
+//  Only ticks with something to do are visited, however long the cpu was idle
+static void TimeWheelRun(TimeWheel * wheel, uint64_t time)
+{
+    uint64_t last = time >> TIME_WHEEL_TICK_LOG2;
+    uint64_t tick;
+
+    while ((tick = TimeWheelNext(wheel)) <= last)
+    {
+        // Cascade each level whose slots start at this tick
+        wheel->now = tick;
+
+        for (uint32_t level = 1; level < TIME_WHEEL_LEVELS; level++)
+        {
+            uint32_t shift = level * TIME_WHEEL_SLOTS_LOG2;
+
+            if (tick & ((1UL << shift) - 1))
+                break;
+
+            TimeWheelCascade(wheel, level, (tick >> shift) % TIME_WHEEL_SLOTS);
+        }
+
+        // Events added by the handlers go in later slots
+        List * slot = TimeSlot(wheel, 0, tick % TIME_WHEEL_SLOTS);
+
+        wheel->now = tick + 1;
+
+        while (!ListIsEmpty(slot))
+        {
+            TimeEvent * event = ListGet(slot->sentinal.next, TimeEvent, node);
+
+            TimeWheelDelete(wheel, event);
+            event->handler(event);
+        }
+    }
+
+    if (wheel->now <= last)
+        wheel->now = last + 1;
+}
+
+void TimeInitCpu(Cpu * cpu)
+{
+    TimeWheel * wheel = &cpu->timer;
+
+    STATIC_ASSERT(TIME_WHEEL_LEVELS * TIME_WHEEL_SLOTS * sizeof(List) <= 0x1000);
+
+    wheel->slots = KMemAllocate();
+    if (wheel->slots == NULL)
+        Panic("TimeInitCpu: out of memory");
+
+    for (int i = 0; i < TIME_WHEEL_LEVELS * TIME_WHEEL_SLOTS; i++)
+        ListInit(&wheel->slots[i]);
+
+    for (int i = 0; i < TIME_WHEEL_LEVELS; i++)
+        wheel->occupied[i] = 0;
+
+    wheel->now = 0;
+    wheel->deadline = TIME_NEVER;
+}
+
+void TimeInterrupt(void)
+{
+    TimeWheel * wheel = &CpuCurrent()->timer;
+
+    // The timer stops after it fires
+    wheel->deadline = TIME_NEVER;
+
+    TimeWheelRun(wheel, TimeNow());
+
+    uint64_t next = TimeWheelNext(wheel);
+    TimeSetTimer(wheel, next == TIME_NEVER ? TIME_NEVER : next << TIME_WHEEL_TICK_LOG2);
+
+    // The handlers only wake threads, switching them is left to the scheduler
+    SchedTimer();
+}
+
+void TimeEventAdd(TimeEvent * event, uint64_t time)
+{
+    TimeWheel * wheel = &CpuCurrent()->timer;
+
+    if (TimeEventPending(event))
+        TimeWheelDelete(wheel, event);
+
+    // An empty wheel can skip straight to the present (there's nothing to cascade)
+    if (TimeWheelIsEmpty(wheel))
+        wheel->now = (TimeNow() >> TIME_WHEEL_TICK_LOG2) + 1;
+
+    event->time = time;
+    uint64_t tick = TimeWheelInsert(wheel, event);
+
+    if ((tick << TIME_WHEEL_TICK_LOG2) < wheel->deadline)
+        TimeSetTimer(wheel, tick << TIME_WHEEL_TICK_LOG2);
+}
+
+void TimeEventCancel(TimeEvent * event)
+{
+    if (TimeEventPending(event))
+        TimeWheelDelete(&CpuCurrent()->timer, event);
+}
+
 TimePeriod TimeMakePeriod(uint64_t microSeconds)
 {
     // Handle zero
@@ -70,5 +326,5 @@ uint64_t TimeExpandPeriodBase(TimePeriod period, uint64_t base)
 
 uint64_t TimeExpandPeriod(TimePeriod period)
 {
-    return TimeExpandPeriodBase(period, InfoPage.clock);
+    return TimeExpandPeriodBase(period, TimeNow());
 }
@@ -44,40 +44,64 @@ InfoUserSyscalls:
     .quad scSchedule            - PrivKipBase
     .quad 0
 
+.macro EnterKernel, num:req
+    # Enters the kernel using the given system call number (SYSCALL_ in syscall.h)
+    #  Arguments are in the normal function call registers
+    mov r10, rcx
+    mov eax, \num
+    syscall
+    ret
+.endm
+
     .align 16
 pscSpaceControl:
+    EnterKernel 0
 
     .align 16
 pscThreadControl:
+    EnterKernel 1
 
     .align 16
 pscProcessorControl:
+    EnterKernel 2
 
     .align 16
 pscMemoryControl:
+    EnterKernel 3
 
     .align 16
 scIpc:
+    EnterKernel 4
 
     .align 16
 scLipc:
+    EnterKernel 5
 
     .align 16
 scUnmap:
+    EnterKernel 6
 
     .align 16
 scExchangeRegisters:
+    EnterKernel 7
 
     .align 16
 scSystemClock:
-    # Read system clock from info page
-    mov rax, [rip + (PrivKipBase + 0xA0)]
+    # Convert the time stamp counter to microseconds using the info page
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, [rip + (PrivKipBase + 0xA0)]
+    mul qword ptr [rip + (PrivKipBase + 0xB0)]
+    shrd rax, rdx, 32
     ret
 
     .align 16
 scThreadSwitch:
+    EnterKernel 8
 
     .align 16
 scSchedule:
+    EnterKernel 9
 
 InfoUserSyscallsEnd: